@@ -4,14 +4,17 @@
 
 #include "mitm.hpp"
 #include "sequential/pcs_engine.hpp"
+#include "sequential/naive.hpp"
 #include "double_speck64_problem.hpp"
 
 int n = 20;         // default problem size (easy)
 u64 seed = 0x1337;  // default fixed seed
+int naive = 0;      // 1: exhaustive search with a hash table, 2: with a sort-merge join
+int threads = 0;    // naive search with a hash table, multithreaded (0: single-threaded)
 
 mitm::Parameters process_command_line_options(int argc, char **argv)
 {
-    struct option longopts[9] = {
+    struct option longopts[11] = {
         {"ram", required_argument, NULL, 'r'},
         {"difficulty", required_argument, NULL, 'd'},
         {"n", required_argument, NULL, 'n'},
@@ -19,6 +22,9 @@ mitm::Parameters process_command_line_options(int argc, char **argv)
         {"nrounds", required_argument, NULL, 'o'},
         {"alpha", required_argument, NULL, 'a'},
         {"beta", required_argument, NULL, 'b'},
+        {"naive", no_argument, NULL, 'v'},
+        {"join", no_argument, NULL, 'j'},
+        {"threads", required_argument, NULL, 't'},
         {NULL, 0, NULL, 0}
     };
 
@@ -50,6 +56,16 @@ mitm::Parameters process_command_line_options(int argc, char **argv)
         case 'o':
             params.max_versions = std::stoull(optarg, 0);
             break;            
+        case 'v':
+            naive = 1;
+            break;
+        case 'j':
+            naive = 2;
+            break;
+        case 't':
+            naive = 1;
+            threads = std::stoi(optarg);
+            break;
         default:
             errx(1, "Unknown option %s\n", optarg);
         }
@@ -64,6 +80,18 @@ int main(int argc, char* argv[])
         printf("double-speck64 demo! seed=%016" PRIx64 ", n=%d\n", prng.seed, n); 
 
         mitm::DoubleSpeck64_Problem Pb(n, prng);            
+        if (naive) {
+            vector<pair<u64, u64>> claws;
+            if (naive == 2)
+                claws = mitm::naive_claw_search_join(Pb);
+            else if (threads > 0)
+                claws = mitm::naive_claw_search_threaded(Pb, threads);
+            else
+                claws = mitm::naive_claw_search(Pb, params);
+            for (auto [x0, x1] : claws)
+                printf("f(%" PRIx64 ") = g(%" PRIx64 ")\n", x0, x1);
+            return EXIT_SUCCESS;
+        }
         auto claw = mitm::claw_search<mitm::ScalarSequentialEngine>(Pb, params, prng);
         if (claw) {
             auto [x0, x1] = *claw;
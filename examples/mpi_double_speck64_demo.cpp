@@ -11,16 +11,27 @@
 
 int n = 20;         // default problem size (easy)
 u64 seed = 0;       // default random seed
+bool auto_tune = false;  // calibrate recv_per_node and buffer_capacity
 
 
 
 mitm::Parameters process_command_line_options(int argc, char **argv, mitm::MpiParameters &params)
 {
-    struct option longopts[5] = {
+    struct option longopts[15] = {
         {"ram", required_argument, NULL, 'r'},
         {"n", required_argument, NULL, 'n'},
         {"seed", required_argument, NULL, 's'},
         {"recv-per-node", required_argument, NULL, 'e'},
+        {"aggregate", no_argument, NULL, 'a'},
+        {"fold-controller", no_argument, NULL, 'c'},
+        {"shared-dict", no_argument, NULL, 'd'},
+        {"shm-rings", no_argument, NULL, 'm'},
+        {"rma", no_argument, NULL, 'o'},
+        {"progress-every", required_argument, NULL, 'p'},
+        {"weighted", no_argument, NULL, 'w'},
+        {"calibrate", no_argument, NULL, 't'},
+        {"groups", required_argument, NULL, 'g'},
+        {"symmetric", no_argument, NULL, 'y'},
         {NULL, 0, NULL, 0}
     };
 
@@ -41,6 +52,36 @@ mitm::Parameters process_command_line_options(int argc, char **argv, mitm::MpiPa
         case 'e':
             params.recv_per_node = std::stoi(optarg);
             break;
+        case 'a':
+            params.aggregate = true;
+            break;
+        case 'c':
+            params.dedicated_controller = false;
+            break;
+        case 'd':
+            params.shared_dict = true;
+            break;
+        case 'm':
+            params.shm_rings = true;
+            break;
+        case 'o':
+            params.rma = true;
+            break;
+        case 'p':
+            params.progress_every = std::stoi(optarg);
+            break;
+        case 'w':
+            params.weighted = true;
+            break;
+        case 't':
+            auto_tune = true;
+            break;
+        case 'g':
+            params.n_groups = std::stoi(optarg);
+            break;
+        case 'y':
+            params.symmetric = true;
+            break;
         default:
             errx(1, "Unknown option %s\n", optarg);
         }
@@ -54,7 +95,6 @@ int main(int argc, char* argv[])
 
     mitm::MpiParameters params;
     process_command_line_options(argc, argv, params);
-    params.setup(MPI_COMM_WORLD);
 
     if (seed == 0) {
         seed = mitm::PRNG::read_urandom();
@@ -62,11 +102,14 @@ int main(int argc, char* argv[])
     }
 
     mitm::PRNG prng(seed);
-    if (params.role == mitm::CONTROLLER)
-        printf("double-speck64 demo! seed=%016" PRIx64 ", n=%d\n", prng.seed, n); 
     mitm::DoubleSpeck64_Problem Pb(n, prng);
+    if (auto_tune)
+        mitm::calibrate(Pb, params, MPI_COMM_WORLD);
+    params.setup(MPI_COMM_WORLD);
+    if (params.verbose)
+        printf("double-speck64 demo! seed=%016" PRIx64 ", n=%d\n", prng.seed, n); 
     auto claw = mitm::claw_search<mitm::MpiEngine>(Pb, params, prng);
-    if (claw && params.role == mitm::CONTROLLER) {
+    if (claw && params.verbose) {
         auto [x0, x1] = *claw;
         printf("f(%" PRIx64 ") = g(%" PRIx64 ")\n", x0, x1);
     }
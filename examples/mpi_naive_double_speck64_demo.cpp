@@ -11,14 +11,25 @@
 int n = 20;         // default problem size (easy)
 u64 seed = 0x1337;  // default fixed seed
 bool expensive;
+bool alltoall;      // run the all-to-all version as well
+bool pipelined;     // ... with the communications in the background
+int n_targets = 1;  // instances (seed, seed + 1, ...) that share f, done at once
 
 void process_command_line_options(int argc, char **argv, mitm::MpiParameters &params)
 {
-    struct option longopts[5] = {
+    struct option longopts[13] = {
         {"n", required_argument, NULL, 'n'},
         {"seed", required_argument, NULL, 's'},
         {"recv-per-node", required_argument, NULL, 'e'},
         {"expensive", no_argument, NULL, 'p'},
+        {"alltoall", no_argument, NULL, 'a'},
+        {"pipelined", no_argument, NULL, 'l'},
+        {"fingerprint-bits", required_argument, NULL, 'f'},
+        {"prefilter-bits", required_argument, NULL, 'b'},
+        {"external", required_argument, NULL, 'x'},
+        {"ram", required_argument, NULL, 'r'},
+        {"dict-file", required_argument, NULL, 'd'},
+        {"targets", required_argument, NULL, 't'},
         {NULL, 0, NULL, 0}
     };
 
@@ -39,6 +50,31 @@ void process_command_line_options(int argc, char **argv, mitm::MpiParameters &pa
         case 'p':
             expensive = 1;
             break;
+        case 'a':
+            alltoall = 1;
+            break;
+        case 'l':
+            alltoall = 1;
+            pipelined = 1;
+            break;
+        case 'f':
+            params.fingerprint_bits = std::stoi(optarg);
+            break;
+        case 'b':
+            params.prefilter_bits = std::stoi(optarg);
+            break;
+        case 'x':
+            params.external_dir = optarg;
+            break;
+        case 'r':
+            params.nbytes_memory = mitm::human_parse(optarg);
+            break;
+        case 'd':
+            params.dict_file = optarg;
+            break;
+        case 't':
+            n_targets = std::stoi(optarg);
+            break;
         default:
             errx(1, "Unknown option %s\n", optarg);
         }
@@ -62,25 +98,53 @@ int main(int argc, char* argv[])
     params.setup(MPI_COMM_WORLD, 0);  // no controller process
     mitm::DoubleSpeck64_Problem Pb(n, prng);
     
-#if 0
-    if (params.verbose) {
-        printf("==============================================================\n");
-        printf("All-to-all version\n");
-        if (expensive) printf("expensive f/g\n");
-        printf("==============================================================\n");
+    if (alltoall) {
+        if (params.verbose) {
+            printf("==============================================================\n");
+            printf("All-to-all version%s\n", pipelined ? " (pipelined)" : "");
+            if (expensive) printf("expensive f/g\n");
+            printf("==============================================================\n");
+        }
+        vector<pair<u64, u64>> claws_alltoall;
+        if (expensive && pipelined)
+            claws_alltoall = mitm::naive_mpi_claw_search_alltoall_pipelined<true>(Pb, params);
+        else if (pipelined)
+            claws_alltoall = mitm::naive_mpi_claw_search_alltoall_pipelined<false>(Pb, params);
+        else if (expensive)
+            claws_alltoall = mitm::naive_mpi_claw_search_alltoall<true>(Pb, params);
+        else
+            claws_alltoall = mitm::naive_mpi_claw_search_alltoall<false>(Pb, params);
+        if (params.verbose)
+            for (auto it = claws_alltoall.begin(); it != claws_alltoall.end(); it++) {
+                auto [x0, x1] = *it;
+                assert(Pb.f(x0) == Pb.g(x1));
+                printf("f(%" PRIx64 ") = g(%" PRIx64 ")\n", x0, x1);
+            }
     }
-    vector<pair<u64, u64>> claws_alltoall, claws_isend;
-    if (expensive)
-        claws_alltoall = mitm::naive_mpi_claw_search_alltoall<true>(Pb, params);
-    else
-        claws_alltoall = mitm::naive_mpi_claw_search_alltoall<false>(Pb, params);
-    if (params.verbose)
-        for (auto it = claws_alltoall.begin(); it != claws_alltoall.end(); it++) {
-            auto [x0, x1] = *it;
-            assert(Pb.f(x0) == Pb.g(x1));
-            printf("f(%" PRIx64 ") = g(%" PRIx64 ")\n", x0, x1);
+    if (n_targets > 1) {
+        /* the plaintext is fixed, so f is the same for all the instances: only g changes */
+        vector<mitm::DoubleSpeck64_Problem> targets;
+        for (int t = 0; t < n_targets; t++) {
+            mitm::PRNG tprng(seed + t);
+            targets.push_back(mitm::DoubleSpeck64_Problem(n, tprng));
+        }
+        vector<vector<pair<u64, u64>>> claws;
+        if (expensive)
+            claws = mitm::naive_mpi_claw_search_isend_multi<true>(targets, params);
+        else
+            claws = mitm::naive_mpi_claw_search_isend_multi<false>(targets, params);
+        for (int t = 0; t < n_targets; t++) {
+            if (params.verbose)
+                for (auto [x0, x1] : claws[t]) {
+                    assert(targets[t].f(x0) == targets[t].g(x1));
+                    printf("target %d: f(%" PRIx64 ") = g(%" PRIx64 ")\n", t, x0, x1);
+                }
+            assert(claws[t].size() == 1);
         }
-#endif
+        MPI_Finalize();
+        return EXIT_SUCCESS;
+    }
+
     if (params.verbose) {
         printf("==============================================================\n");
         printf("Isend version.\n");
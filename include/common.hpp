@@ -18,7 +18,9 @@ public:
     /* hardware-dependent */
     u64 nbytes_memory = 0;        /* how much RAM to use on each machine */
     int n_nodes = 1;              /* #hosts (with shared RAM) */
-    int n_recv = 1;               /* #instances of the dictionary */
+    int n_recv = 1;               /* #receiver processes */
+    int n_dict = 1;               /* #instances of the dictionary (== n_recv, unless receivers share them) */
+    u64 end_divisor = 1;          /* ends of trails are stored as x / end_divisor (the rest is implied by the dict) */
 
     /* algorithm parameters */
     double alpha = 2.5;           /* auto-chosen theta == alpha * sqrt(w/n) */
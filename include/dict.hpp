@@ -5,6 +5,17 @@
 #ifndef MITM_SEQUENTIAL_DICT_HPP
 #define MITM_SEQUENTIAL_DICT_HPP
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "tools.hpp"
 
 // various dictionnaries
@@ -13,55 +24,458 @@ namespace mitm {
 
 /*
  * this is a "classic" hash table for 64-bit key-value pairs, with linear probing.  
- * No false negatives, some false positives.  12 bytes per entry. 
+ * No false negatives, some false positives.  12 bytes per slot: a 32-bit fingerprint in one 
+ * array, a 64-bit value in another.
+ *
+ * Structure-of-arrays layout: slots come in buckets of 16, whose fingerprints fill a cache line 
+ * and are compared all at once (AVX-512, or 2x AVX2).  Free slots may be anywhere in a bucket 
+ * (concurrent inserts can leave holes), so lookups check all 16 of them.  Linear probing goes 
+ * from bucket to bucket: a bucket with a free slot ends the search.  Buckets are picked by 
+ * multiply-shift (no division).
+ *
+ * A dict can be saved to a file, and later mapped back in memory (copy-on-write) instead of 
+ * being rebuilt.  File layout: a 64-byte header (magic, #buckets, tag), the fingerprints, the
+ * values.  The tag identifies the content (the caller decides what it depends on).
  */
 class CompactDict {
 public:
+    static constexpr int bucket_size = 16;
+    static constexpr u32 EMPTY = 0xffffffff;
+    const u64 n_buckets;
     const u64 n_slots;     /* How many slots a dictionary have */
-    struct __attribute__ ((packed)) entry { u32 k; u64 v; };
 
-    vector<struct entry> A;
+private:
+    static constexpr u64 MAGIC = 0x7463694474636d43ull;
+    static constexpr size_t header_size = 64;
+
+    vector<u32> storage;   // fingerprints (with room for alignment)
+    u32 *K;                // K[16 * b : 16 * (b + 1)] == bucket b, 64-byte aligned
+    vector<u64> values;
+    u64 *V;                // values (in `values`, or mapped)
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    struct Mapping {
+        void *addr;
+        size_t size;
+    };
+
+    static Mapping map_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+            err(1, "cannot open %s", path.c_str());
+        if ((size_t) st.st_size < header_size)
+            errx(1, "%s: not a saved dict", path.c_str());
+        void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            err(1, "cannot map %s", path.c_str());
+        close(fd);
+        return {addr, (size_t) st.st_size};
+    }
+
+    CompactDict(Mapping m, u64 tag) : n_buckets(((u64 *) m.addr)[1]), n_slots(n_buckets * bucket_size), 
+                                      mapping(m.addr), mapping_size(m.size)
+    {
+        u64 *header = (u64 *) m.addr;
+        if (header[0] != MAGIC || m.size != header_size + n_slots * (sizeof(u32) + sizeof(u64)))
+            errx(1, "not a saved dict, or a truncated one");
+        if (header[2] != tag)
+            errx(1, "the saved dict does not match this problem");
+        K = (u32 *) ((char *) m.addr + header_size);
+        V = (u64 *) (K + n_slots);
+    }
+
+    u64 bucket_of(u64 key) const
+    {
+        u64 h = key * 0x9e3779b97f4a7c15ull;
+        return ((unsigned __int128) h * n_buckets) >> 64;
+    }
+
+    static u32 fingerprint(u64 key)
+    {
+        u32 k = key ^ (key >> 32);
+        return (k == EMPTY) ? 0 : k;
+    }
+
+    /* bit i is set iff bucket[i] == x */
+    static u32 match(const u32 *bucket, u32 x)
+    {
+#if defined(__AVX512F__)
+        __m512i v = _mm512_load_si512((const __m512i *) bucket);
+        return _mm512_cmpeq_epi32_mask(v, _mm512_set1_epi32(x));
+#elif defined(__AVX2__)
+        __m256i y = _mm256_set1_epi32(x);
+        __m256i lo = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i *) bucket), y);
+        __m256i hi = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i *) (bucket + 8)), y);
+        return _mm256_movemask_ps((__m256) lo) | (_mm256_movemask_ps((__m256) hi) << 8);
+#else
+        u32 mask = 0;
+        for (int i = 0; i < bucket_size; i++)
+            mask |= (u32) (bucket[i] == x) << i;
+        return mask;
+#endif
+    }
+
+    void prefetch(u64 key) const
+    {
+        u64 b = bucket_of(key);
+        __builtin_prefetch(K + bucket_size * b);
+        __builtin_prefetch(&V[bucket_size * b]);
+        __builtin_prefetch(&V[bucket_size * b + 8]);
+    }
+
+    /* found(value) for each slot of the chain of key whose fingerprint matches */
+    template<class Found>
+    void scan(u64 key, Found &&found) const
+    {
+        u64 b = bucket_of(key);
+        u32 fp = fingerprint(key);
+        for (;;) {
+            const u32 *bucket = K + bucket_size * b;
+            for (u32 hits = match(bucket, fp); hits != 0; hits &= hits - 1)
+                found(V[bucket_size * b + __builtin_ctz(hits)]);
+            if (match(bucket, EMPTY) != 0)
+                return;
+            b += 1;
+            if (b == n_buckets)
+                b = 0;
+        }
+    }
+
+public:
+    CompactDict(u64 n_slots) : n_buckets((n_slots + bucket_size - 1) / bucket_size), n_slots(n_buckets * bucket_size)
+    {
+        storage.resize(this->n_slots + bucket_size, EMPTY);
+        u64 misalignment = ((uintptr_t) storage.data() / sizeof(u32)) % bucket_size;
+        K = storage.data() + (bucket_size - misalignment) % bucket_size;
+        values.resize(this->n_slots);
+        V = values.data();
+    }
+
+    /* map the dict saved in `path`, that must have this tag */
+    CompactDict(const std::string &path, u64 tag) : CompactDict(map_file(path), tag) {}
+
+    CompactDict(const CompactDict &) = delete;
+
+    ~CompactDict()
+    {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_size);
+    }
+
+    void save(const std::string &path, u64 tag) const
+    {
+        u64 header[header_size / sizeof(u64)] = {MAGIC, n_buckets, tag};
+        FILE *file = fopen(path.c_str(), "wb");
+        if (file == NULL)
+            err(1, "cannot create %s", path.c_str());
+        if (fwrite(header, 1, header_size, file) != header_size
+            || fwrite(K, sizeof(u32), n_slots, file) != n_slots
+            || fwrite(V, sizeof(u64), n_slots, file) != n_slots
+            || fclose(file) != 0)
+            err(1, "cannot write to %s", path.c_str());
+    }
+
+    double bytes_per_slot() const
+    {
+        return sizeof(u32) + sizeof(u64);
+    }
 
-    CompactDict(u64 n_slots) : n_slots(n_slots)
+    void clear()
     {
-        A.resize(n_slots, {0xffffffff, 0});
+        std::fill(K, K + n_slots, EMPTY);
     }
 
     void insert(u64 key, u64 value)
     {
-        u64 h = (key ^ (key >> 32)) % n_slots;
+        u64 b = bucket_of(key);
         for (;;) {
-            if (A[h].k == 0xffffffff)
-                break;
-            h += 1;
-            if (h == n_slots)
-                h = 0;
+            u32 free = match(K + bucket_size * b, EMPTY);
+            if (free != 0) {
+                u64 h = bucket_size * b + __builtin_ctz(free);
+                K[h] = fingerprint(key);
+                V[h] = value;
+                return;
+            }
+            b += 1;
+            if (b == n_buckets)
+                b = 0;
         }
-        A[h].k = key % 0xfffffffb;
-        A[h].v = value;
     }
 
-    // return possible values matching this key
-    // TODO: replace this by a custom iterator
-    int probe(u64 bigkey, u64 keys[])
+    /* 
+     * Same as insert(), but several threads may do it at once (not while others probe).  Slots
+     * are claimed by a CAS on their fingerprint, among those seen free: they need not be the 
+     * leftmost ones by then.  Since slots never become free again, a bucket that another thread 
+     * fills meanwhile is just skipped.
+     */
+    void insert_concurrent(u64 key, u64 value)
     {
-        u32 key = bigkey % 0xfffffffb;
-        u64 h = (bigkey ^ (bigkey >> 32)) % n_slots;
-        int nkeys = 0;
+        u64 b = bucket_of(key);
+        u32 fp = fingerprint(key);
         for (;;) {
-            if (A[h].k == 0xffffffff)
-                return nkeys;
-            if (A[h].k == key) {
-                keys[nkeys] = A[h].v;
-                nkeys += 1;
+            for (u32 free = match(K + bucket_size * b, EMPTY); free != 0; free &= free - 1) {
+                u64 h = bucket_size * b + __builtin_ctz(free);
+                u32 expected = EMPTY;
+                if (__atomic_compare_exchange_n(&K[h], &expected, fp, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    V[h] = value;
+                    return;
+                }
             }
-            h += 1;
-            if (h == n_slots)
-                h = 0;
+            b += 1;
+            if (b == n_buckets)
+                b = 0;
+        }
+    }
+
+    // return possible values matching this key
+    int probe(u64 bigkey, u64 keys[]) const
+    {
+        int nkeys = 0;
+        scan(bigkey, [&](u64 value) { keys[nkeys++] = value; });
+        return nkeys;
+    }
+
+    /* 
+     * probe with bigkeys[0:n]: found(i, value) for each possible value matching bigkeys[i].
+     * The buckets of the next keys are prefetched meanwhile.
+     */
+    template<class Found>
+    void probe_many(const u64 *bigkeys, size_t n, Found &&found) const
+    {
+        constexpr size_t ahead = 8;
+        for (size_t i = 0; i < n && i < ahead; i++)
+            prefetch(bigkeys[i]);
+        for (size_t i = 0; i < n; i++) {
+            if (i + ahead < n)
+                prefetch(bigkeys[i + ahead]);
+            scan(bigkeys[i], [&](u64 value) { found(i, value); });
+        }
+    }
+};
+
+/*
+ * Same interface as CompactDict, but smaller: values have at most `value_bits` bits, and each 
+ * slot only holds the value and a `fingerprint_bits`-bit fingerprint of the key, packed in 
+ * value_bits + fingerprint_bits bits (at most 56).  The (hashed) key is split into a quotient,
+ * that is implied by the slot where its chain starts, and a remainder, whose top bits are the
+ * fingerprint.  Linear probing.  No false negatives; wider fingerprints give fewer false positives.
+ */
+class QuotientDict {
+public:
+    const u64 n_slots;
+    const int value_bits;
+    const int fingerprint_bits;
+
+private:
+    const int width;       // bits per slot
+    const int shift;       // the fingerprint is in h[shift:shift + fingerprint_bits]
+    const u64 value_mask;
+    const u64 slot_mask;
+    vector<u8> A;          // slot i == A[i * width : (i + 1) * width] (in bits).  0 == empty
+
+    static u64 hash(u64 key)
+    {
+        return murmur64(key);
+    }
+
+    u64 home(u64 h) const
+    {
+        return ((unsigned __int128) h * n_slots) >> 64;
+    }
+
+    /* nonzero, so that an occupied slot is never 0 */
+    u64 fingerprint(u64 h) const
+    {
+        u64 fp = (h >> shift) & make_mask(fingerprint_bits);
+        return (fp == 0) ? 1 : fp;
+    }
+
+    u64 get(u64 i) const
+    {
+        u64 bit = i * width;
+        u64 word;
+        memcpy(&word, &A[bit / 8], sizeof(word));
+        return (word >> (bit % 8)) & slot_mask;
+    }
+
+    void set(u64 i, u64 entry)
+    {
+        u64 bit = i * width;
+        u64 word;
+        memcpy(&word, &A[bit / 8], sizeof(word));
+        word &= ~(slot_mask << (bit % 8));
+        word |= entry << (bit % 8);
+        memcpy(&A[bit / 8], &word, sizeof(word));
+    }
+
+    void prefetch(u64 key) const
+    {
+        __builtin_prefetch(&A[home(hash(key)) * width / 8]);
+    }
+
+    /* found(value) for each slot of the chain of key whose fingerprint matches */
+    template<class Found>
+    void scan(u64 key, Found &&found) const
+    {
+        u64 h = hash(key);
+        u64 fp = fingerprint(h);
+        for (u64 i = home(h);; ) {
+            u64 entry = get(i);
+            if (entry == 0)
+                return;
+            if ((entry >> value_bits) == fp)
+                found(entry & value_mask);
+            i += 1;
+            if (i == n_slots)
+                i = 0;
+        }
+    }
+
+public:
+    QuotientDict(u64 n_slots, int value_bits, int fingerprint_bits) 
+        : n_slots(n_slots), value_bits(value_bits), fingerprint_bits(fingerprint_bits), 
+          width(value_bits + fingerprint_bits), shift(std::max<int>(0, 64 - std::log2(n_slots + 1) - fingerprint_bits)),
+          value_mask(make_mask(value_bits)), slot_mask(make_mask(width))
+    {
+        if (fingerprint_bits < 1 || width > 56)
+            errx(1, "QuotientDict: %d-bit values with %d-bit fingerprints do not fit in 56 bits", value_bits, fingerprint_bits);
+        A.resize((n_slots * width + 7) / 8 + sizeof(u64), 0);
+    }
+
+    double bytes_per_slot() const
+    {
+        return width / 8.;
+    }
+
+    void clear()
+    {
+        std::fill(A.begin(), A.end(), 0);
+    }
+
+    void insert(u64 key, u64 value)
+    {
+        assert((value & value_mask) == value);
+        u64 h = hash(key);
+        u64 i = home(h);
+        while (get(i) != 0) {
+            i += 1;
+            if (i == n_slots)
+                i = 0;
+        }
+        set(i, (fingerprint(h) << value_bits) | value);
+    }
+
+    // return possible values matching this key
+    int probe(u64 bigkey, u64 keys[]) const
+    {
+        int nkeys = 0;
+        scan(bigkey, [&](u64 value) { keys[nkeys++] = value; });
+        return nkeys;
+    }
+
+    /* cf. CompactDict */
+    template<class Found>
+    void probe_many(const u64 *bigkeys, size_t n, Found &&found) const
+    {
+        constexpr size_t ahead = 8;
+        for (size_t i = 0; i < n && i < ahead; i++)
+            prefetch(bigkeys[i]);
+        for (size_t i = 0; i < n; i++) {
+            if (i + ahead < n)
+                prefetch(bigkeys[i + ahead]);
+            scan(bigkeys[i], [&](u64 value) { found(i, value); });
         }
     }
 };
 
+/*
+ * Blocked Bloom filter in an array of 64-bit words (owned by the caller): each key sets k bits
+ * of a single word, so that a lookup touches a single cache line.  No false negatives.
+ */
+class BloomFilter {
+public:
+    u64 *words;
+    u64 n_words;
+    int k;
+
+    BloomFilter(u64 *words, u64 n_words, int bits_per_key) 
+        : words(words), n_words(n_words), k(std::clamp((int) std::lround(0.69 * bits_per_key), 1, 8)) {}
+
+    static u64 n_words_for(u64 n_keys, int bits_per_key)
+    {
+        return std::max<u64>(1, (n_keys * bits_per_key + 63) / 64);
+    }
+
+    void insert(u64 key)
+    {
+        u64 h = murmur64(key);
+        words[word(h)] |= mask(h);
+    }
+
+    bool contains(u64 key) const
+    {
+        u64 h = murmur64(key);
+        u64 m = mask(h);
+        return (words[word(h)] & m) == m;
+    }
+
+private:
+    /* the word comes from the high bits of h, the bits in it from the low ones */
+    u64 word(u64 h) const
+    {
+        return ((unsigned __int128) h * n_words) >> 64;
+    }
+
+    u64 mask(u64 h) const
+    {
+        u64 m = 0;
+        for (int i = 0; i < k; i++)
+            m |= 1ull << ((h >> (6 * i)) & 63);
+        return m;
+    }
+};
+
+/* run body(dict) with a CompactDict, or a QuotientDict when fingerprint_bits > 0 */
+template<class Body>
+auto with_claw_dict(u64 n_slots, int value_bits, int fingerprint_bits, Body &&body)
+{
+    if (fingerprint_bits > 0) {
+        QuotientDict dict(n_slots, value_bits, fingerprint_bits);
+        return body(dict);
+    }
+    CompactDict dict(n_slots);
+    return body(dict);
+}
+
+/* what with_claw_dict() would use per slot */
+inline double claw_dict_bytes_per_slot(int value_bits, int fingerprint_bits)
+{
+    if (fingerprint_bits > 0)
+        return (value_bits + fingerprint_bits) / 8.;
+    return sizeof(u32) + sizeof(u64);
+}
+
+/*
+ * Multi-pass naive search, when the dict does not fit: in pass p, only the keys of slice p are
+ * stored, and only those are probed.  n_passes() gives enough passes for `bytes` of dict to fit 
+ * in nbytes_memory (1 if it is 0).  Slices are picked by hashing, independently of the receivers
+ * and of the hash of QuotientDict (otherwise a pass would only fill a region of the dict).
+ */
+inline u64 n_passes(double bytes, u64 nbytes_memory)
+{
+    if (nbytes_memory == 0)
+        return 1;
+    return std::max<u64>(1, std::ceil(bytes / nbytes_memory));
+}
+
+inline u64 slice_of(u64 key, u64 n_passes)
+{
+    return ((unsigned __int128) murmur64(key ^ 0x5851f42d4c957f2dull) * n_passes) >> 64;
+}
+
 /*
  * This dictionnary, when probed with the distinguished point at the end of a trail,
  * should provide (if any) the start (and the length) of another distinguished point
@@ -74,8 +488,10 @@ public:
 	u64 len_mask;
 	u64 key_mask;
 	const u64 n_slots;     /* size of A */
+	const bool shared;     /* A is updated concurrently by several processes */
 	
-	vector<u64> A;         // A[i][0:jbits] == j.  A[i][jbits:lbits] == len1.  A[lbits:64] == key bits
+	u64 *A;                // A[i][0:jbits] == j.  A[i][jbits:lbits] == len1.  A[lbits:64] == key bits
+	vector<u64> storage;   // (when we own A)
   	
 	static u64 get_nslots(u64 nbytes, u64 forced_multiple)
 	{
@@ -83,23 +499,40 @@ public:
 		return (w / forced_multiple) * forced_multiple;
 	}
 
-	PcsDict(u64 jbits, u64 w) : jbits(jbits), n_slots(w)
+	/* 
+	 * When `memory` is given, the dictionary lives there and is shared with others (updates are atomic).
+	 * It is not cleared: each user is supposed to flush its part.
+	 */
+	PcsDict(u64 jbits, u64 w, u64 *memory = nullptr) : jbits(jbits), n_slots(w), shared(memory != nullptr)
 	{
 		assert(jbits <= 56);
 		jmask = make_mask(jbits);
 		lmask = make_mask(8);
 		lbits = jbits + 8;
 		key_mask = (lbits == 64) ? 0 : 0xffffffffffffffff << lbits;
-		A.resize(n_slots);
-		flush();
+		if (shared) {
+			A = memory;
+		} else {
+			storage.resize(n_slots);
+			A = storage.data();
+			flush();
+		}
 	}
 
+	PcsDict(const PcsDict &) = delete;
+
 	/*
 	 * Reset keys, and counters.
 	 */
 	void flush()
 	{
-		for (u64 i = 0; i < n_slots; i++)
+		flush(0, n_slots);
+	}
+
+	/* reset the slots in [lo:hi] */
+	void flush(u64 lo, u64 hi)
+	{
+		for (u64 i = lo; i < hi; i++)
 			A[i] = 0;
 	}
   
@@ -109,15 +542,24 @@ public:
 		u64 idx = end % n_slots;
 		u64 key = (end / n_slots) << lbits;
 
-		u64 e = A[idx];
-		u64 ekey = e & key_mask;
-		u64 elen = (e >> jbits) & lmask;
-
-		if (e == 0 || len0 >= elen) {
+		if (len0 > lmask)
+			len0 = lmask;
+		u64 e = shared ? __atomic_load_n(&A[idx], __ATOMIC_RELAXED) : A[idx];
+		u64 ekey, elen;
+		for (;;) {
+			ekey = e & key_mask;
+			elen = (e >> jbits) & lmask;
+			if (e != 0 && len0 < elen)
+				break;
 			// actual insertion
-			if (len0 > lmask)
-				len0 = lmask;
-			A[idx] = start ^ (len0 << jbits) ^ key;
+			u64 fresh = start ^ (len0 << jbits) ^ key;
+			if (not shared) {
+				A[idx] = fresh;
+				break;
+			}
+			// if someone else wrote the slot meanwhile, e is updated: try again
+			if (__atomic_compare_exchange_n(&A[idx], &e, fresh, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
 		}
 
 		if (ekey != key || e == 0)
@@ -142,7 +142,7 @@ optional<tuple<u64,u64,u64>> walk_nolen1(ProblemWrapper& wrapper, Counters &ctr,
             break;
     }
 
-    if (x1 / params.n_recv != end0) {
+    if (x1 / params.end_divisor != end0) {
         ctr.walk_noncolliding();
         return nullopt; 
     }
@@ -0,0 +1,235 @@
+#ifndef MITM_EXTERNAL
+#define MITM_EXTERNAL
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <memory>
+#include <err.h>
+
+#include "tools.hpp"
+
+/*
+ * Out-of-core storage of (key, value) pairs, for when they do not fit in RAM.
+ */
+
+namespace mitm {
+
+/*
+ * Pairs are accumulated in a buffer of `capacity` pairs.  When it is full, it is sorted by key and
+ * written to a file as a run, with large sequential writes.  If keys are cheap to recompute from
+ * the values, only the values are written (store_key == false).  Then the runs are read back in
+ * key order by a k-way merge.
+ */
+class SortedRuns {
+	std::string path;
+	size_t capacity;
+	bool store_key;
+	FILE *file;
+	vector<pair<u64, u64>> buffer;
+	vector<pair<u64, u64>> runs;       // (offset, #pairs) in the file
+	u64 offset = 0;
+	vector<u64> out;
+
+	void write_run()
+	{
+		if (buffer.empty())
+			return;
+		std::sort(buffer.begin(), buffer.end());
+		out.clear();
+		for (auto [key, value] : buffer) {
+			if (store_key)
+				out.push_back(key);
+			out.push_back(value);
+		}
+		if (fwrite(out.data(), sizeof(u64), out.size(), file) != out.size())
+			err(1, "cannot write to %s", path.c_str());
+		runs.push_back(pair(offset, buffer.size()));
+		offset += out.size() * sizeof(u64);
+		buffer.clear();
+	}
+
+	/* reads a run sequentially */
+	class Reader {
+		FILE *file;
+		u64 remaining;                     // #pairs not yet read in the buffer
+		bool store_key;
+		vector<u64> buf;
+		vector<u64> keys;                  // recomputed for the whole buffer (if not stored)
+		size_t pos = 0;
+
+		template<class KeyFn>
+		void refill(KeyFn &keyfn)
+		{
+			size_t width = store_key ? 2 : 1;
+			size_t n = std::min<u64>(remaining, buf.capacity() / width);
+			buf.resize(n * width);
+			if (fread(buf.data(), sizeof(u64), buf.size(), file) != buf.size())
+				err(1, "cannot read back a run");
+			if (not store_key) {
+				keys.resize(n);
+				keyfn(buf.data(), keys.data(), n);
+			}
+			remaining -= n;
+			pos = 0;
+		}
+
+	public:
+		Reader(const std::string &path, u64 offset, u64 size, bool store_key, size_t chunk)
+			: remaining(size), store_key(store_key)
+		{
+			file = fopen(path.c_str(), "rb");
+			if (file == NULL || fseek(file, offset, SEEK_SET) != 0)
+				err(1, "cannot read back %s", path.c_str());
+			buf.reserve(chunk);
+		}
+
+		~Reader()
+		{
+			fclose(file);
+		}
+
+		/* the next (key, value) of the run, if any */
+		template<class KeyFn>
+		bool next(u64 &key, u64 &value, KeyFn &keyfn)
+		{
+			if (pos == buf.size()) {
+				if (remaining == 0)
+					return false;
+				refill(keyfn);
+			}
+			if (store_key) {
+				key = buf[pos];
+				value = buf[pos + 1];
+				pos += 2;
+			} else {
+				value = buf[pos];
+				key = keys[pos];
+				pos += 1;
+			}
+			return true;
+		}
+	};
+
+public:
+	/* the file is created in `path`, and removed by the destructor */
+	SortedRuns(const std::string &path, size_t capacity, bool store_key)
+		: path(path), capacity(capacity), store_key(store_key)
+	{
+		file = fopen(path.c_str(), "w+b");
+		if (file == NULL)
+			err(1, "cannot create %s", path.c_str());
+		buffer.reserve(capacity);
+	}
+
+	SortedRuns(const SortedRuns &) = delete;
+
+	~SortedRuns()
+	{
+		fclose(file);
+		remove(path.c_str());
+	}
+
+	void add(u64 key, u64 value)
+	{
+		if (buffer.size() == capacity)
+			write_run();
+		buffer.push_back(pair(key, value));
+	}
+
+	/* write the last run.  Call this before reading them back */
+	void close()
+	{
+		write_run();
+		vector<pair<u64, u64>>().swap(buffer);
+		if (fflush(file) != 0)
+			err(1, "cannot write to %s", path.c_str());
+	}
+
+	size_t n_runs() const
+	{
+		return runs.size();
+	}
+
+	/* 
+	 * Reads all the pairs back, in key order (k-way merge of the runs).  When keys are not 
+	 * stored, keyfn(values, keys, n) recomputes them, a buffer at a time.  Each run gets a read buffer of `chunk` words.
+	 */
+	template<class KeyFn>
+	class Merger {
+		using Head = tuple<u64, u64, size_t>;   // key, value, run
+		KeyFn keyfn;
+		vector<std::unique_ptr<Reader>> reader;
+		std::priority_queue<Head, vector<Head>, std::greater<Head>> heap;
+
+	public:
+		Merger(const SortedRuns &runs, KeyFn keyfn, size_t chunk) : keyfn(keyfn)
+		{
+			for (auto [offset, size] : runs.runs) {
+				reader.push_back(std::make_unique<Reader>(runs.path, offset, size, runs.store_key, chunk));
+				u64 key, value;
+				if (reader.back()->next(key, value, keyfn))
+					heap.push(Head(key, value, reader.size() - 1));
+			}
+		}
+
+		/* the next (key, value), if any */
+		bool next(u64 &key, u64 &value)
+		{
+			if (heap.empty())
+				return false;
+			size_t r;
+			std::tie(key, value, r) = heap.top();
+			heap.pop();
+			u64 k, v;
+			if (reader[r]->next(k, v, keyfn))
+				heap.push(Head(k, v, r));
+			return true;
+		}
+	};
+
+	template<class KeyFn>
+	Merger<KeyFn> merger(KeyFn keyfn, size_t chunk = 1 << 17) const
+	{
+		return Merger<KeyFn>(*this, keyfn, chunk);
+	}
+};
+
+/*
+ * Stream both sets of runs in key order, and call found(value_f, value_g) for each pair with the
+ * same key.  Only the values of F with the current key are kept in memory.
+ */
+template<class KeyF, class KeyG, class Found>
+void merge_join(const SortedRuns &F, const SortedRuns &G, KeyF keyf, KeyG keyg, Found found)
+{
+	auto f = F.merger(keyf);
+	auto g = G.merger(keyg);
+	u64 kf, vf, kg, vg;
+	bool more_f = f.next(kf, vf);
+	bool more_g = g.next(kg, vg);
+	vector<u64> same;
+	while (more_f && more_g) {
+		if (kf < kg) {
+			more_f = f.next(kf, vf);
+		} else if (kg < kf) {
+			more_g = g.next(kg, vg);
+		} else {
+			u64 key = kf;
+			same.clear();
+			while (more_f && kf == key) {
+				same.push_back(vf);
+				more_f = f.next(kf, vf);
+			}
+			while (more_g && kg == key) {
+				for (u64 v : same)
+					found(v, vg);
+				more_g = g.next(kg, vg);
+			}
+		}
+	}
+}
+
+}
+#endif
@@ -1,6 +1,10 @@
 #ifndef MITM_MPI_COMMON
 #define MITM_MPI_COMMON
 
+#include <deque>
+#include <new>
+#include <utility>
+#include <algorithm>
 #include <mpi.h>
 #include <err.h>
 
@@ -8,51 +12,138 @@
 
 namespace mitm {
 
-enum tags {TAG_INTERCOMM, TAG_POINTS, TAG_SENDER_CALLHOME, TAG_RECEIVER_CALLHOME, TAG_ASSIGNMENT, TAG_SOLUTION};
+enum tags {TAG_INTERCOMM, TAG_POINTS, TAG_SENDER_CALLHOME, TAG_RECEIVER_CALLHOME, TAG_ASSIGNMENT, TAG_SOLUTION, TAG_VERSION, TAG_PARTITION};
 enum role {CONTROLLER, SENDER, RECEIVER, UNDECIDED};
-enum assignment {KEEP_GOING, NEW_VERSION};
+enum assignment {KEEP_GOING, NEW_VERSION, STOP};
+
+/* 
+ * DPs of the v-th version travel on the inter-communicator with this tag, so that 
+ * the streams of consecutive versions can overlap.
+ */
+inline int version_tag(u64 version)
+{
+	return TAG_POINTS + (int) (version % 1024);
+}
 
 
 class MpiParameters : public Parameters {
 public:
 	int recv_per_node = 1;
+	bool dedicated_controller = true;      /* otherwise rank 0 runs the controller and is a sender as well */
 	int buffer_capacity = 1500;            // somewhat arbitrary
+	int buffer_depth = 2;                  /* #buffers in flight from each sender to each receiver */
+	int recv_pool = 8;                     /* #buffers of each receiver for an incoming stream */
+	int max_backlog = 4;                   /* #full buffers a sender may keep for a slow receiver */
+	int progress_every = 0;                /* senders let MPI progress every ... iterations (0: only when a buffer fills) */
 	double ping_delay = 0.1;
+	bool aggregate = false;                /* two-level routing: senders --> node aggregator --> node --> receivers */
+	int aggregate_capacity = 6000;         /* size of the buffers between nodes, in the two-level routing */
+	bool shared_dict = false;              /* the receivers of a node share a single dictionary */
+	bool shm_rings = false;                /* DPs for a receiver of the same node go through shared memory */
+	bool rma = false;                      /* DPs go through one-sided MPI_Put into rings exposed by the receivers */
+	bool weighted = false;                 /* DPs are split between receivers according to their measured speed */
+	int n_groups = 1;                      /* independent sub-clusters, each with its own controller and dict */
+	bool symmetric = false;                /* every process (but the controller) is both a sender and a receiver */
+	int fingerprint_bits = 0;              /* naive engines: compact dict with fingerprints this wide (0: CompactDict) */
+	int prefilter_bits = 0;                /* naive Isend engine: senders filter g(x) with a Bloom filter of the dicts (bits / entry; 0: none) */
+	std::string external_dir;              /* naive Isend engine: sorted runs on disk in this directory instead of the dict (empty: in RAM) */
+	std::string dict_file;                 /* naive Isend engine: save the dict in these files after phase 0, or reuse it (empty: no) */
 
-	MPI_Comm world_comm;
+	MPI_Comm world_comm;                    /* our group (everybody, unless there are several groups) */
 	MPI_Comm inter_comm;
 	MPI_Comm local_comm;                    /* just our side of the intercomm */
+	MPI_Comm node_comm;                     /* processes on the same node */
+	MPI_Comm abort_comm;                    /* private copy of world_comm for the abort signal */
+	MPI_Comm numa_comm;                     /* processes on the same NUMA zone of the same node */
 	int role = UNDECIDED;                   /* enum role */
 	int rank, size;                         // for the global communicator
 	int local_rank, local_size;             /* rank among the local group of the inter-communicator */
 	int n_send;
 	int n_nodes;
+	int node_id;                            /* in [0:n_nodes] */
+	int n_numa;                             /* #NUMA zones on our node */
+	int numa_id;                            /* in [0:n_numa] */
+	vector<int> recv_ranks;                 /* global ranks of the receivers */
+	vector<int> recv_node;                  /* node of each receiver */
+
+	/* several groups only */
+	int group_id = 0;
+	MPI_Comm global_comm;                   /* all the groups */
+	MPI_Comm controllers_comm;              /* the controllers of all groups (ranks == group_id) */
+	/* one-sided transport or symmetric mode only */
+	MPI_Comm work_comm;                     /* senders and receivers (symmetric: == local_comm) */
+	/* two-level routing or shared-memory rings only */
+	MPI_Comm node_work_comm;                /* senders and receivers of the same node */
+	/* two-level routing only */
+	MPI_Comm node_inter_comm;               /* senders <--> receivers of the same node */
+	/* two-level routing or shared dictionary only */
+	MPI_Comm recv_node_comm;                /* receivers of the same node */
+
+	/* receivers on a given node, in increasing order (== ranks in their recv_node_comm) */
+	vector<int> receivers_of_node(int node) const
+	{
+		vector<int> result;
+		for (int k = 0; k < n_recv; k++)
+			if (recv_node[k] == node)
+				result.push_back(k);
+		return result;
+	}
 
 	void setup(MPI_Comm comm)
 	{
 		setup(comm, 1);
 	}
 
+	/* 
+	 * Split `comm` into nodes (the processes that share memory) and set n_nodes and node_id.  
+	 * Return the communicator of our node.  Collective over `comm`.
+	 */
+	MPI_Comm detect_nodes(MPI_Comm comm)
+	{
+		MPI_Comm node;
+		MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+	
+		/* determine the number of nodes (== #processes of node-rank 0) */
+		int comm_rank, node_rank;
+		MPI_Comm_rank(comm, &comm_rank);
+		MPI_Comm_rank(node, &node_rank);
+		int is_rank0 = (node_rank == 0) ? 1 : 0;
+		MPI_Allreduce(&is_rank0, &n_nodes, 1, MPI_INT, MPI_SUM, comm);
+		MPI_Comm leaders_comm;
+		MPI_Comm_split(comm, is_rank0 ? 0 : MPI_UNDEFINED, comm_rank, &leaders_comm);
+		if (is_rank0) {
+			MPI_Comm_rank(leaders_comm, &node_id);
+			MPI_Comm_free(&leaders_comm);
+		}
+		MPI_Bcast(&node_id, 1, MPI_INT, 0, node);
+		return node;
+	}
+
 	void setup(MPI_Comm comm, bool controller)
 	{
+		/* groups of consecutive ranks: with the usual mapping, they live on consecutive nodes */
+		global_comm = comm;
 		world_comm = comm;
+		if (n_groups > 1) {
+			int global_rank, global_size;
+			MPI_Comm_rank(global_comm, &global_rank);
+			MPI_Comm_size(global_comm, &global_size);
+			group_id = (u64) global_rank * n_groups / global_size;
+			MPI_Comm_split(global_comm, group_id, global_rank, &world_comm);
+		}
 		MPI_Comm_size(world_comm, &size);
 		MPI_Comm_rank(world_comm, &rank);
-		verbose = (rank == 0);
-		if (controller && rank == 0)
+		verbose = (rank == 0 && group_id == 0);
+		if (n_groups > 1)
+			MPI_Comm_split(global_comm, (rank == 0) ? 0 : MPI_UNDEFINED, group_id, &controllers_comm);
+		if (controller && dedicated_controller && rank == 0)
 			role = CONTROLLER;
 	
-		/* create a subcommunicator inside each node */
-		MPI_Comm node_comm;
-		MPI_Comm_split_type(world_comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
-	
-		/* determine the number of nodes (== #processes of node-rank 0) */
-		int node_rank;
+		MPI_Comm_dup(world_comm, &abort_comm);
+
+		node_comm = detect_nodes(world_comm);
 		int node_size;
-		MPI_Comm_rank(node_comm, &node_rank);
 		MPI_Comm_size(node_comm, &node_size);
-		int is_rank0 = (node_rank == 0) ? 1 : 0;
-		MPI_Allreduce(&is_rank0, &n_nodes, 1, MPI_INT, MPI_SUM, world_comm);
 		if (verbose) {
 			printf("MPI: detected %d nodes\n", n_nodes);
 			/* verification */
@@ -64,62 +155,61 @@ public:
 		int check_hi, check_lo;
 		MPI_Allreduce(&node_size, &check_lo, 1, MPI_INT, MPI_MIN, world_comm);
 		MPI_Allreduce(&node_size, &check_hi, 1, MPI_INT, MPI_MAX, world_comm);
-		if (role == CONTROLLER) {
+		if (verbose) {
 			if (check_lo != check_hi)
 				printf("MPI: WARNING!!! process / node varies from %d to %d\n", check_lo, check_hi);
 			else
 				printf("MPI: each node runs %d processes\n", check_lo);
 		}
-		MPI_Comm_free(&node_comm);
-
-#if 0 
-		// NUMA stuff. Let's keep this for later
-		/* split each node comm into a NUMA comm */
-		MPI_Comm numa_comm;
-		// this is according to the spec
-		// MPI_Info info;
-		// MPI_Info_create(&info);
-		// MPI_Info_set(info, "mpi_hw_resource_type", "NUMANode");
-		// MPI_Comm_split_type(node_comm, MPI_COMM_TYPE_HW_GUIDED, 0, info, &numa_comm);
-	
-		// this works for OpenMPI
-		MPI_Comm_split_type(node_comm, OMPI_COMM_TYPE_NUMA, 0, MPI_INFO_NULL, &numa_comm);
-	
-		/* how many of us in the NUMA comm? */
-		int numa_rank;
-		int numa_size;
-		MPI_Comm_size(numa_comm, &numa_size);
+
+		/* split each node into NUMA zones */
+		setup_numa();
+		int numa_rank, numa_size;
 		MPI_Comm_rank(numa_comm, &numa_rank);
-	
-		/* count NUMA comms */
-		int n_numa;
-		int is_numarank0 = (numa_rank == 0) ? 1 : 0;
-		MPI_Allreduce(&is_numarank0, &n_numa, 1, MPI_INT, MPI_SUM, world_comm);
-	
-		/* check size of NUMA comms */
-		MPI_Allreduce(&numa_size, &check_lo, 1, MPI_INT, MPI_MIN, world_comm);
-		MPI_Allreduce(&numa_size, &check_hi, 1, MPI_INT, MPI_MAX, world_comm);
-	
-		if (master) {
-			if (check_lo != check_hi)
-				printf("MPI: WARNING! #process / #NUMA zones varies from %d to %d\n", check_lo, check_hi);
-			else
-				printf("MPI: detected %d NUMA zones per node\n", size / check_lo / n_nodes);
-		}
-#endif	
+		MPI_Comm_size(numa_comm, &numa_size);
 		
-		/* decide sender / receiver */
-		if (node_rank >= node_size - recv_per_node)
+		/* decide sender / receiver: the receivers are spread evenly over the NUMA zones of the node */
+		int recv_in_zone = recv_per_node / n_numa + ((numa_id < recv_per_node % n_numa) ? 1 : 0);
+		if (symmetric) {
+			if (role == UNDECIDED)
+				role = SENDER;           // (and a receiver as well)
+		} else if (numa_rank >= numa_size - recv_in_zone)
 			role = RECEIVER;
 		else if (role == UNDECIDED)
 			role = SENDER;
 		/* safety check */
 		assert(role != UNDECIDED);
+		if (controller && not dedicated_controller && rank == 0 && role != SENDER)
+			errx(1, "MPI: ERROR! The controller can only be folded into a sender (rank 0 is a receiver)");
+		if (n_groups > 1 && not controller)
+			errx(1, "MPI: ERROR! Only the PCS engine runs in several groups");
+		if (rma && (aggregate || shm_rings))
+			errx(1, "MPI: ERROR! The one-sided transport replaces the two-level routing and the shared-memory rings");
+		if (weighted && shared_dict)
+			errx(1, "MPI: ERROR! Weighted partitioning needs a dictionary per receiver");
+		if (symmetric && (aggregate || shm_rings || rma || shared_dict))
+			errx(1, "MPI: ERROR! The symmetric mode only works with direct MPI transport and a dictionary per process");
+		if (symmetric && controller && not dedicated_controller)
+			errx(1, "MPI: ERROR! The symmetric mode needs a dedicated controller");
 		/* count them */
 		n_recv = (role == RECEIVER) ? 1 : 0;
 		MPI_Allreduce(MPI_IN_PLACE, &n_recv, 1, MPI_INT, MPI_SUM, world_comm);
 		n_send = (role == SENDER) ? 1 : 0;
 		MPI_Allreduce(MPI_IN_PLACE, &n_send, 1, MPI_INT, MPI_SUM, world_comm);
+		if (symmetric)
+			n_recv = n_send;
+		n_dict = shared_dict ? n_nodes : n_recv;
+		end_divisor = weighted ? 1 : n_dict;
+		vector<int> roles(size);
+		vector<int> nodes(size);
+		MPI_Allgather(&role, 1, MPI_INT, roles.data(), 1, MPI_INT, world_comm);
+		MPI_Allgather(&node_id, 1, MPI_INT, nodes.data(), 1, MPI_INT, world_comm);
+		for (int r = 0; r < size; r++)
+			if (roles[r] == RECEIVER || (symmetric && roles[r] == SENDER)) {
+				recv_ranks.push_back(r);
+				recv_node.push_back(nodes[r]);
+			}
+		print_numa_zones();
 		if (verbose) {
 			printf("MPI: # sender   processes = %d\n", n_send);
 			printf("MPI: # receiver processes = %d\n", n_recv);
@@ -137,7 +227,11 @@ public:
 		MPI_Comm_split(world_comm, role, 0, &local_comm);
 		MPI_Comm_rank(local_comm, &local_rank);
 		MPI_Comm_size(local_comm, &local_size);
-		if (role != CONTROLLER) {
+		if (symmetric) {
+			/* DPs travel between the senders themselves: receiver index == local_rank */
+			if (role != CONTROLLER)
+				work_comm = local_comm;
+		} else if (role != CONTROLLER) {
 			/* creation of an inter-communicator between senders and receivers */
 			int local_leader;     // in tribe_comm
 			int remote_leader;    // in world_comm
@@ -150,111 +244,518 @@ public:
 			}
 			MPI_Intercomm_create(local_comm, local_leader, world_comm, remote_leader, TAG_INTERCOMM, &inter_comm);
 		}
+
+		if ((aggregate || shared_dict) && role == RECEIVER)
+			MPI_Comm_split(local_comm, node_id, local_rank, &recv_node_comm);
+		if (aggregate || shm_rings) {
+			int color = (role == CONTROLLER) ? MPI_UNDEFINED : node_id;
+			MPI_Comm_split(world_comm, color, rank, &node_work_comm);
+		}
+		if (rma)
+			MPI_Comm_split(world_comm, (role == CONTROLLER) ? MPI_UNDEFINED : 0, rank, &work_comm);
+		if (aggregate)
+			setup_aggregation();
+	}
+
+private:
+	/* 
+	 * Find the NUMA zones of the node.  When the processes are not bound to a zone (or the MPI 
+	 * implementation does not know), each process ends up alone: then the node is a single zone.
+	 */
+	void setup_numa()
+	{
+		numa_comm = MPI_COMM_NULL;
+#if MPI_VERSION >= 4
+		/* this is according to the spec */
+		MPI_Info info;
+		MPI_Info_create(&info);
+		MPI_Info_set(info, "mpi_hw_resource_type", "NUMANode");
+		MPI_Comm_split_type(node_comm, MPI_COMM_TYPE_HW_GUIDED, 0, info, &numa_comm);
+		MPI_Info_free(&info);
+#endif
+#ifdef OPEN_MPI
+		if (numa_comm == MPI_COMM_NULL)
+			MPI_Comm_split_type(node_comm, OMPI_COMM_TYPE_NUMA, 0, MPI_INFO_NULL, &numa_comm);
+#endif
+		int numa_size = 0, node_size, biggest;
+		if (numa_comm != MPI_COMM_NULL)
+			MPI_Comm_size(numa_comm, &numa_size);
+		MPI_Comm_size(node_comm, &node_size);
+		MPI_Allreduce(&numa_size, &biggest, 1, MPI_INT, MPI_MAX, node_comm);
+		if (biggest <= 1 && node_size > 1) {
+			if (numa_comm != MPI_COMM_NULL)
+				MPI_Comm_free(&numa_comm);
+			MPI_Comm_dup(node_comm, &numa_comm);
+		}
+
+		/* number the zones inside the node */
+		int numa_rank, node_rank;
+		MPI_Comm_rank(numa_comm, &numa_rank);
+		MPI_Comm_rank(node_comm, &node_rank);
+		int is_numarank0 = (numa_rank == 0) ? 1 : 0;
+		MPI_Allreduce(&is_numarank0, &n_numa, 1, MPI_INT, MPI_SUM, node_comm);
+		MPI_Comm zones_comm;
+		MPI_Comm_split(node_comm, is_numarank0 ? 0 : MPI_UNDEFINED, node_rank, &zones_comm);
+		if (is_numarank0) {
+			MPI_Comm_rank(zones_comm, &numa_id);
+			MPI_Comm_free(&zones_comm);
+		}
+		MPI_Bcast(&numa_id, 1, MPI_INT, 0, numa_comm);
+	}
+
+	/* #senders and #receivers in each NUMA zone (summed over all nodes) */
+	void print_numa_zones()
+	{
+		int max_numa;
+		MPI_Allreduce(&n_numa, &max_numa, 1, MPI_INT, MPI_MAX, world_comm);
+		vector<int> count(2 * max_numa, 0);
+		if (role == SENDER)
+			count[2 * numa_id] = 1;
+		if (role == RECEIVER)
+			count[2 * numa_id + 1] = 1;
+		MPI_Allreduce(MPI_IN_PLACE, count.data(), 2 * max_numa, MPI_INT, MPI_SUM, world_comm);
+		if (not verbose)
+			return;
+		printf("MPI: detected %d NUMA zones per node\n", max_numa);
+		for (int z = 0; z < max_numa; z++)
+			printf("MPI:   zone %d: %d senders, %d receivers\n", z, count[2 * z], count[2 * z + 1]);
+	}
+
+	/* communicator for the first hop (inside each node).  The last one uses recv_node_comm */
+	void setup_aggregation()
+	{
+		if (role == CONTROLLER)
+			return;
+
+		int node_work_rank;
+		MPI_Comm_rank(node_work_comm, &node_work_rank);
+		int first_rank[2];               // of senders / receivers in node_work_comm
+		first_rank[0] = (role == SENDER) ? node_work_rank : INT_MAX;
+		first_rank[1] = (role == RECEIVER) ? node_work_rank : INT_MAX;
+		MPI_Allreduce(MPI_IN_PLACE, first_rank, 2, MPI_INT, MPI_MIN, node_work_comm);
+		if (first_rank[0] == INT_MAX || first_rank[1] == INT_MAX)
+			errx(1, "MPI: ERROR! Two-level routing needs at least one sender and one receiver on each node");
+
+		MPI_Comm node_local_comm;
+		MPI_Comm_split(node_work_comm, role, 0, &node_local_comm);
+		int remote_leader = (role == SENDER) ? first_rank[1] : first_rank[0];
+		MPI_Intercomm_create(node_local_comm, 0, node_work_comm, remote_leader, TAG_INTERCOMM, &node_inter_comm);
+		MPI_Comm_free(&node_local_comm);
 	}
 };
 
+/* number of processes on the other side: the remote group of an inter-communicator, or everybody */
+inline int n_peers(MPI_Comm comm)
+{
+	int inter, n;
+	MPI_Comm_test_inter(comm, &inter);
+	if (inter)
+		MPI_Comm_remote_size(comm, &n);
+	else
+		MPI_Comm_size(comm, &n);
+	return n;
+}
+
+
+/*
+ * Memory for the transport buffers comes from MPI_Alloc_mem (it may be registered with the 
+ * network card).  Elements are default-initialized, so that resize() does not clear anything.
+ */
+template<class T>
+struct MpiAllocator {
+	using value_type = T;
 
-/* Manages send buffers for a collection of receiver processes, with double-buffering */
+	MpiAllocator() = default;
+	template<class U> MpiAllocator(const MpiAllocator<U> &) {}
+
+	T* allocate(size_t n)
+	{
+		void *ptr;
+		if (MPI_Alloc_mem(n * sizeof(T), MPI_INFO_NULL, &ptr) != MPI_SUCCESS)
+			throw std::bad_alloc();
+		return (T*) ptr;
+	}
+
+	void deallocate(T* ptr, size_t)
+	{
+		MPI_Free_mem(ptr);
+	}
+
+	template<class U, class... Args>
+	void construct(U *ptr, Args&&... args)
+	{
+		::new ((void *) ptr) U(std::forward<Args>(args)...);
+	}
+
+	template<class U>
+	void construct(U *ptr)
+	{
+		::new ((void *) ptr) U;
+	}
+
+	template<class U> bool operator==(const MpiAllocator<U> &) const { return true; }
+	template<class U> bool operator!=(const MpiAllocator<U> &) const { return false; }
+};
+
+using MpiBuffer = vector<u64, MpiAllocator<u64>>;
+
+
+/*
+ * Weighted partitioning of the DPs between the receivers.  DPs are the integers in [0:threshold],
+ * cut into buckets of consecutive values, and each receiver owns a range of buckets in
+ * proportion to its share.  The receivers then keep the ends of trails in full (end_divisor == 1).
+ */
+class Partition {
+	int shift;
+	vector<int> owner;                 // bucket --> receiver
+
+public:
+	Partition(const MpiParameters &params)
+	{
+		u64 n_buckets = 64 * params.n_recv;
+		for (shift = 0; (params.threshold >> shift) >= n_buckets; shift++) {}
+		owner.resize((params.threshold >> shift) + 1);
+		balance(vector<double>(params.n_recv, 1));
+	}
+
+	/* give each receiver a range of buckets proportional to its share */
+	void balance(const vector<double> &share)
+	{
+		double total = 0;
+		for (double s : share)
+			total += s;
+		size_t n = owner.size();
+		double acc = 0;
+		size_t lo = 0;
+		for (size_t t = 0; t < share.size(); t++) {
+			acc += share[t];
+			size_t hi = (t + 1 == share.size()) ? n : std::min<size_t>(n, std::llround(acc / total * n));
+			for (size_t b = lo; b < hi; b++)
+				owner[b] = t;
+			lo = std::max(lo, hi);
+		}
+	}
+
+	int operator()(u64 x) const
+	{
+		return owner[x >> shift];
+	}
+};
+
+
+/* 
+ * Manages send buffers for a collection of receiver processes.  We never have more than 
+ * `depth` buffers in flight towards each receiver: they are sent in synchronous mode, and a 
+ * "credit" comes back when the receiver has matched the message (cf. RecvBuffers: it only
+ * does so when it has room).  When a receiver is out of credits, full buffers wait in a 
+ * backlog and we keep working.  We only wait when this backlog is full; its size adapts to 
+ * the stalls that have been observed.
+ *
+ * Each slot in flight has a fixed buffer, and full buffers go through a persistent request 
+ * (re-created when the tag changes).  Incomplete buffers and end-of-stream markers, that 
+ * only occur at the end of a stream, use ordinary requests.
+ *
+ * The receivers are all the processes on the other side of the communicator, or only the 
+ * given `peers` (ranks, maybe none): then receiver i is peers[i].
+ */
 class SendBuffers {
 public:
-	using Buffer = vector<u64>;
+	using Buffer = MpiBuffer;
 	double waiting_time = 0;
 	u64 bytes_sent = 0;
+	bool elastic = false;                  /* never wait: let the backlog grow as needed */
 
 private:
+	struct Pending {
+		int tag;
+		Buffer data;
+	};
+
 	MPI_Comm inter_comm;
 	size_t capacity;
 	int tag;
 	int n;
-	
-	vector<Buffer> ready;
-	vector<Buffer> outgoing;
-	vector<MPI_Request> request;   /* for the OUTGOING buffers */
+	vector<int> peer;                      /* rank of each receiver */
+	int depth;                             /* #buffers in flight to each receiver */
+	size_t max_backlog = 0;                /* #full buffers kept for each receiver before waiting */
+	size_t backlog_limit;                  /* max_backlog never exceeds this */
+
+	vector<Buffer> ready;                  /* being filled */
+	vector<std::deque<Pending>> backlog;   /* full, waiting for a credit */
+	vector<Buffer> outgoing;               /* in flight.  outgoing[i * depth + k] goes to receiver i */
+	vector<MPI_Request> request;           /* for the OUTGOING buffers (maybe a copy of persistent[s]) */
+	vector<MPI_Request> persistent;        /* sends a full outgoing[s] */
+	vector<int> persistent_tag;
+	vector<int> completed;                 /* for MPI_Testsome */
+	vector<Buffer> spare;                  /* recycled buffers */
 
-	/* initiate transmission of the i-th OUTGOING buffer */
-	void start_send(int i)
+	/* to adapt max_backlog */
+	double total_wait = 0;
+	u64 total_bytes = 0;
+	double last_adapt;
+	double last_wait = 0;
+	u64 last_bytes = 0;
+
+	/* all the processes on the other side */
+	static vector<int> everybody(MPI_Comm comm)
 	{
-		if (outgoing[i].size() == 0)  // do NOT send empty buffers. These are interpreted as "I am done"
-			return;
-		MPI_Isend(outgoing[i].data(), outgoing[i].size(), MPI_UINT64_T, i, tag, inter_comm, &request[i]);
-		bytes_sent += outgoing[i].size() * sizeof(u64);
+		vector<int> all(n_peers(comm));
+		for (size_t i = 0; i < all.size(); i++)
+			all[i] = i;
+		return all;
 	}
 
-	void switch_when_full(int rank)
+	Buffer new_buffer()
 	{
-		if (ready[rank].size() == capacity) {
-			// ready buffer is full: finish sending the outgoing buffer
-			double start = wtime();
-			MPI_Wait(&request[rank], MPI_STATUS_IGNORE);
-			waiting_time += wtime() - start;
-			outgoing[rank].clear();
-			// swap and start sending
-			std::swap(ready[rank], outgoing[rank]);
-			start_send(rank);
+		Buffer b;
+		if (spare.empty()) {
+			b.reserve(capacity);
+		} else {
+			std::swap(b, spare.back());
+			spare.pop_back();
 		}
+		return b;
+	}
+
+	/* move the ready buffer of the i-th receiver to its backlog (with the current tag) */
+	void enqueue(int i)
+	{
+		Pending p = {tag, new_buffer()};
+		std::swap(p.data, ready[i]);
+		backlog[i].push_back(std::move(p));
+	}
+
+	/* send p from slot s */
+	void start_send(int s, Pending &p)
+	{
+		int i = s / depth;
+		size_t size = p.data.size();
+		std::copy(p.data.begin(), p.data.end(), outgoing[s].begin());
+		if (size == capacity) {
+			if (persistent_tag[s] != p.tag) {
+				if (persistent[s] != MPI_REQUEST_NULL)
+					MPI_Request_free(&persistent[s]);
+				MPI_Ssend_init(outgoing[s].data(), capacity, MPI_UINT64_T, peer[i], p.tag, inter_comm, &persistent[s]);
+				persistent_tag[s] = p.tag;
+			}
+			request[s] = persistent[s];
+			MPI_Start(&request[s]);
+		} else {
+			MPI_Issend(outgoing[s].data(), size, MPI_UINT64_T, peer[i], p.tag, inter_comm, &request[s]);
+		}
+		bytes_sent += size * sizeof(u64);
+		total_bytes += size * sizeof(u64);
+		p.data.clear();
+		spare.push_back(std::move(p.data));
+	}
+
+	/* send as much of the backlog of the i-th receiver as its credits allow */
+	void start_sends(int i)
+	{
+		for (int k = 0; k < depth && not backlog[i].empty(); k++) {
+			int s = i * depth + k;
+			if (request[s] != MPI_REQUEST_NULL) {
+				int done;
+				MPI_Test(&request[s], &done, MPI_STATUS_IGNORE);
+				if (not done)
+					continue;
+				request[s] = MPI_REQUEST_NULL;     // (only the handle of a persistent request)
+			}
+			// slot s is free.  Messages are sent (and thus matched) in backlog order
+			start_send(s, backlog[i].front());
+			backlog[i].pop_front();
+		}
+	}
+
+	/* 
+	 * Wait until some receiver gives a credit back, and use it.  Keep feeding all the 
+	 * receivers meanwhile: a receiver may need data stuck in our backlog to get going.
+	 */
+	void wait_credit()
+	{
+		double start = wtime();
+		int s;
+		MPI_Waitany(n * depth, request.data(), &s, MPI_STATUS_IGNORE);
+		assert(s != MPI_UNDEFINED);
+		request[s] = MPI_REQUEST_NULL;
+		start_sends(s / depth);
+		double delta = wtime() - start;
+		waiting_time += delta;
+		total_wait += delta;
+	}
+
+	/*
+	 * Let the backlog absorb the stalls: over the last period, we waited W seconds and 
+	 * produced data at R bytes/s the rest of the time.  Keep enough buffers for R*W more bytes.
+	 */
+	void adapt()
+	{
+		double now = wtime();
+		double delta = now - last_adapt;
+		if (delta < 1)
+			return;
+		double waited = total_wait - last_wait;
+		double rate = (total_bytes - last_bytes) / std::max(delta - waited, 1e-3);
+		size_t needed = std::ceil(rate * waited / n / (capacity * sizeof(u64)));
+		max_backlog = std::min(backlog_limit, std::max(needed, max_backlog / 2));
+		last_adapt = now;
+		last_wait = total_wait;
+		last_bytes = total_bytes;
+	}
+
+	void switch_when_full(int rank, size_t width)
+	{
+		if (ready[rank].size() + width <= capacity)
+			return;
+		enqueue(rank);
+		start_sends(rank);
+		while (not elastic && backlog[rank].size() > max_backlog)
+			wait_credit();
+		adapt();
 	}
 
 public:
-	SendBuffers(MPI_Comm inter_comm, int tag, size_t capacity) : inter_comm(inter_comm), capacity(capacity), tag(tag)
+	SendBuffers(MPI_Comm inter_comm, int tag, size_t capacity, int depth, size_t backlog_limit, const vector<int> &peers) 
+		: inter_comm(inter_comm), capacity(capacity), tag(tag), n(peers.size()), peer(peers), depth(depth), 
+		  backlog_limit(backlog_limit)
 	{
-		MPI_Comm_remote_size(inter_comm, &n);
+		assert(depth >= 1);
 		ready.resize(n);
-		outgoing.resize(n);
-		request.resize(n, MPI_REQUEST_NULL);
-		for (int i = 0; i < n; i++) {
+		backlog.resize(n);
+		outgoing.resize(n * depth);
+		request.resize(n * depth, MPI_REQUEST_NULL);
+		persistent.resize(n * depth, MPI_REQUEST_NULL);
+		persistent_tag.resize(n * depth, -1);
+		completed.resize(n * depth);
+		for (int i = 0; i < n; i++)
 			ready[i].reserve(capacity);
-			outgoing[i].reserve(capacity);
-		}
+		for (int s = 0; s < n * depth; s++)
+			outgoing[s].resize(capacity);
+		last_adapt = wtime();
+	}
+
+	SendBuffers(MPI_Comm inter_comm, int tag, size_t capacity, int depth = 1, size_t backlog_limit = 0) 
+		: SendBuffers(inter_comm, tag, capacity, depth, backlog_limit, everybody(inter_comm)) {}
+
+	~SendBuffers()
+	{
+		for (int s = 0; s < n * depth; s++)
+			if (persistent[s] != MPI_REQUEST_NULL)
+				MPI_Request_free(&persistent[s]);
 	}
 
 	/* add a new item to the send buffer. Send if necessary */
 	void push(u64 x, int rank)
 	{
-		switch_when_full(rank);
+		switch_when_full(rank, 1);
 		ready[rank].push_back(x);
 	}
 
 	void push2(u64 x, u64 y, int rank)
 	{
-		switch_when_full(rank);
+		switch_when_full(rank, 2);
 		ready[rank].push_back(x);
 		ready[rank].push_back(y);
 	}
 
 	void push3(u64 x, u64 y, u64 z, int rank)
 	{
-		switch_when_full(rank);
+		switch_when_full(rank, 3);
 		ready[rank].push_back(x);
 		ready[rank].push_back(y);
 		ready[rank].push_back(z);
 	}
 
-	/* send and empty all buffers, even if they are incomplete */
-	void flush()
+	/* 
+	 * send all the (incomplete) buffers followed by an end-of-stream marker, then 
+	 * continue with a new stream on another tag.  This does not wait until the data 
+	 * is delivered, so that we may keep working while the receivers catch up.
+	 */
+	void next_stream(int new_tag)
 	{
-		// finish sending all the outgoing buffers
-		double start = wtime();
-		MPI_Waitall(n, request.data(), MPI_STATUSES_IGNORE);
-
-		// send all the (incomplete) ready buffers
 		for (int i = 0; i < n; i++) {
-			std::swap(ready[i], outgoing[i]);
-			start_send(i);
+			if (not ready[i].empty())
+				enqueue(i);
+			// an empty message tells the receiver that we are done with this stream
+			enqueue(i);
+			start_sends(i);
 		}
-		MPI_Waitall(n, request.data(), MPI_STATUSES_IGNORE);
+		tag = new_tag;
+	}
+
+	/* use the credits that came back in the meantime */
+	void progress()
+	{
+		for (int i = 0; i < n; i++)
+			if (not backlog[i].empty())
+				start_sends(i);
+	}
+
+	/*
+	 * Many MPI implementations only move the sends in flight forward while we are inside MPI.
+	 * Calling this from time to time lets them flow instead of arriving in bursts.
+	 */
+	void poke()
+	{
+		int outcount;
+		MPI_Testsome(n * depth, request.data(), &outcount, completed.data(), MPI_STATUSES_IGNORE);
+		progress();
+	}
 
-		// finally tell all receivers that we are done
+	/* (elastic mode) is the backlog of some receiver above the limit? */
+	bool congested() const
+	{
 		for (int i = 0; i < n; i++)
-			MPI_Send(NULL, 0, MPI_UINT64_T, i, tag, inter_comm);
-		waiting_time += wtime() - start;
+			if (backlog[i].size() > backlog_limit)
+				return true;
+		return false;
+	}
+
+	/* same as drain(), but does not block: return true when everything is gone */
+	bool test()
+	{
+		progress();
+		for (int i = 0; i < n; i++)
+			if (not backlog[i].empty())
+				return false;
+		int flag;
+		MPI_Testall(n * depth, request.data(), &flag, MPI_STATUSES_IGNORE);
+		return flag;
+	}
+
+	/* wait until everything is gone */
+	void drain()
+	{
+		for (int i = 0; i < n; i++)
+			while (not backlog[i].empty())
+				wait_credit();
+		double start = wtime();
+		MPI_Waitall(n * depth, request.data(), MPI_STATUSES_IGNORE);
+		double delta = wtime() - start;
+		waiting_time += delta;
+		total_wait += delta;
+	}
+
+	/* send and empty all buffers, even if they are incomplete, and wait until everything is gone */
+	void flush()
+	{
+		next_stream(tag);
+		drain();
 	}
 };
 
 
-/* Manage reception buffers for a collection of sender processes, with double-buffering */
+/* 
+ * Receives a stream of buffers from a collection of sender processes, that ends when each
+ * of them has sent an (empty) end-of-stream marker.  Messages are only matched (MPI_Improbe / 
+ * MPI_Mrecv) when there is room for them in a pool of `pool` buffers shared by all senders: 
+ * this is what gives credits back to the senders (cf. SendBuffers).  The memory used does not 
+ * depend on the number of senders.  These are all the processes on the other side of the 
+ * communicator, unless there are only `n_senders` of them.
+ */
 class RecvBuffers {
 public:
-	using Buffer = vector<u64>;
+	using Buffer = MpiBuffer;
 	double waiting_time = 0;
 	u64 bytes_sent = 0;
 
@@ -264,30 +765,48 @@ private:
 	int n;
 	int tag;
 
-	vector<Buffer> ready;                 // buffers containing points ready to be processed 
-	vector<Buffer> incoming;              // buffers waiting for incoming data
-	vector<MPI_Request> request;
+	vector<Buffer> pool;
+	vector<Buffer *> arrived;             // handed out.  They are recycled by the next call to wait() / test()
 
-	/* initiate reception for a specific sender */
-	void listen_sender(int i)
+	/* receive a matched message into the next free buffer of the pool */
+	void receive(MPI_Message &msg, const MPI_Status &status)
 	{
-		incoming[i].resize(capacity);
-		MPI_Irecv(incoming[i].data(), capacity, MPI_UINT64_T, i, tag, inter_comm, &request[i]);
+		int count;
+		MPI_Get_count(&status, MPI_UINT64_T, &count);
+		Buffer &buffer = pool[arrived.size()];
+		buffer.resize(count);
+		MPI_Mrecv(buffer.data(), count, MPI_UINT64_T, &msg, MPI_STATUS_IGNORE);
+		if (count == 0)
+			n_active_senders -= 1;          // end-of-stream marker
+		else
+			arrived.push_back(&buffer);
+	}
+
+	/* receive what has arrived, as long as there is room */
+	void grab()
+	{
+		while (n_active_senders > 0 && arrived.size() < pool.size()) {
+			int flag;
+			MPI_Message msg;
+			MPI_Status status;
+			MPI_Improbe(MPI_ANY_SOURCE, tag, inter_comm, &flag, &msg, &status);
+			if (not flag)
+				return;
+			receive(msg, status);
+		}
 	}
 
 public:
 	int n_active_senders;                      // # active senders
-	RecvBuffers(MPI_Comm inter_comm, int tag, size_t capacity) : inter_comm(inter_comm), capacity(capacity), tag(tag)
+	RecvBuffers(MPI_Comm inter_comm, int tag, size_t capacity, int pool_size = 1, int n_senders = -1) 
+		: inter_comm(inter_comm), capacity(capacity), tag(tag)
 	{
-		MPI_Comm_remote_size(inter_comm, &n);
-		ready.resize(n);
-		incoming.resize(n);
-		request.resize(n, MPI_REQUEST_NULL);
-		for (int i = 0; i < n; i++) {
-			ready[i].reserve(capacity);
-			incoming[i].reserve(capacity);
-			listen_sender(i);
-		}
+		assert(pool_size >= 1);
+		n = (n_senders >= 0) ? n_senders : n_peers(inter_comm);
+		pool.resize(pool_size);
+		for (auto &buffer : pool)
+			buffer.reserve(capacity);
+		arrived.reserve(pool_size);
 		n_active_senders = n;
 	}
 
@@ -302,40 +821,143 @@ public:
 		return (n_active_senders == 0);
 	}
 
+	/* start listening to a new stream of all senders, on another tag.  Only call this when complete() returned true */
+	void listen(int new_tag)
+	{
+		assert(n_active_senders == 0);
+		tag = new_tag;
+		n_active_senders = n;
+	}
+
+	/* give up on all the senders, whose streams will never come.  Nothing must have arrived */
+	void cancel()
+	{
+		n_active_senders = 0;
+	}
+
 	/* 
 	 * Wait until some data arrives. Returns the buffers that have arrived.
 	 * Only call this when complete() returned false (otherwise, this will wait forever)
-	 * This may destroy the content of all "ready" buffers, so that they have to be processed first
+	 * This recycles all the buffers handed out before, so that they have to be processed first
 	 */
-	vector<Buffer *> wait()
+	const vector<Buffer *> & wait()
 	{
 		assert(n_active_senders > 0);
-		vector<Buffer *> result;
-		int n_done;
-		vector<int> rank_done(n);
-		vector<MPI_Status> statuses(n);
-		double start = wtime();
-		MPI_Waitsome(n, request.data(), &n_done, rank_done.data(), statuses.data());
-		waiting_time += wtime() - start;
-		assert(n_done != MPI_UNDEFINED);
-
-		for (int i = 0; i < n_done; i++) {
-			int j = rank_done[i];
-			std::swap(incoming[j], ready[j]);
-			int count;
-			MPI_Get_count(&statuses[i], MPI_UINT64_T, &count);
-			if (count == 0) {
-				n_active_senders -= 1;
-			} else {
-				ready[j].resize(count);         // matching message size
-				result.push_back(&ready[j]);
-				listen_sender(j);
-			}
+		arrived.clear();
+		for (;;) {
+			grab();
+			if (not arrived.empty() || n_active_senders == 0)
+				return arrived;
+			// only end-of-stream markers so far: block until the next message
+			MPI_Message msg;
+			MPI_Status status;
+			double start = wtime();
+			MPI_Mprobe(MPI_ANY_SOURCE, tag, inter_comm, &msg, &status);
+			waiting_time += wtime() - start;
+			receive(msg, status);
 		}
-		return result;
+	}
+
+	/* same as wait(), but does not block: returns the buffers that have already arrived (maybe none) */
+	const vector<Buffer *> & test()
+	{
+		arrived.clear();
+		grab();
+		return arrived;
+	}
+};
+
+
+/* 
+ * Statistics about one version of the mixing function, summed / min-ed / max-ed at the 
+ * controller with non-blocking reductions, so that nobody waits for the others at the
+ * end of a version.  Each process must start the reductions of all versions in order.
+ */
+class VersionStats {
+public:
+	//             #f send, #f recv, collisions, probe_failures, robinhoods, non-colliding, bad_collisions
+	u64 iavg[7] = {0, 0, 0, 0, 0, 0, 0};
+	//                # send wait  #recv wait
+	double dmin[2] = {HUGE_VAL,    HUGE_VAL};
+	double dmax[2] = {0, 0};
+	double davg[2] = {0, 0};
+
+private:
+	MPI_Request request[4];
+
+public:
+	void reduce(const MpiParameters &params)
+	{
+		const void *inplace = MPI_IN_PLACE;
+		bool root = (params.rank == 0);
+		MPI_Ireduce(root ? inplace : iavg, iavg, 7, MPI_UINT64_T, MPI_SUM, 0, params.world_comm, &request[0]);
+		MPI_Ireduce(root ? inplace : dmin, dmin, 2, MPI_DOUBLE, MPI_MIN, 0, params.world_comm, &request[1]);
+		MPI_Ireduce(root ? inplace : dmax, dmax, 2, MPI_DOUBLE, MPI_MAX, 0, params.world_comm, &request[2]);
+		MPI_Ireduce(root ? inplace : davg, davg, 2, MPI_DOUBLE, MPI_SUM, 0, params.world_comm, &request[3]);
+	}
+
+	bool test()
+	{
+		int flag;
+		MPI_Testall(4, request, &flag, MPI_STATUSES_IGNORE);
+		return flag;
+	}
+
+	void wait()
+	{
+		MPI_Waitall(4, request, MPI_STATUSES_IGNORE);
+	}
+};
+
+/*
+ * Cluster-wide "stop now" flag, raised by the controller.  Everybody else enters a non-blocking
+ * barrier from the start; the controller enters it to raise the flag, and then the barrier completes 
+ * everywhere.  Testing the flag is cheap enough to be done in the hot loops.
+ */
+class AbortSignal {
+	MPI_Request request = MPI_REQUEST_NULL;
+	bool controller;
+	bool raised = false;
+
+public:
+	AbortSignal(const MpiParameters &params) : controller(params.rank == 0)
+	{
+		if (not controller)
+			MPI_Ibarrier(params.abort_comm, &request);
+	}
+
+	/* controller only */
+	void raise(const MpiParameters &params)
+	{
+		if (raised)
+			return;
+		MPI_Ibarrier(params.abort_comm, &request);
+		raised = true;
+	}
+
+	bool test()
+	{
+		if (raised || controller)
+			return raised;
+		int flag;
+		MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+		raised = flag;
+		return raised;
+	}
+
+	void wait()
+	{
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
 	}
 };
 
+/* forget about the reductions that are complete */
+inline void cleanup_stats(std::deque<VersionStats> &stats)
+{
+	while (not stats.empty() && stats.front().test())
+		stats.pop_front();
+}
+
 void BCast_result(MpiParameters &params, vector<pair<u64,u64>> &result)
 {
 	// deal with the results
@@ -364,9 +986,56 @@ void BCast_result(MpiParameters &params, vector<pair<u64,u64>> &result)
 }
 
 
-static void display_stats(u64 N, double start, int vlen, const MpiParameters &params)
+/* 
+ * Time per evaluation of f or g (alternately) with the scalar implementation, for about `duration` 
+ * seconds.  Each evaluation takes the previous output as input, starting from x.
+ */
+template<typename Problem>
+double scalar_eval_time(const Problem& pb, double duration, u64 x)
+{
+    u64 mask = make_mask(pb.n);
+    u64 N = 0;
+    double start = wtime();
+    do {
+        for (int k = 0; k < 1024; k++)
+            x = ((k & 1) ? pb.f(x) : pb.g(x)) & mask;
+        N += 1024;
+    } while (wtime() - start < duration);
+    volatile u64 sink = x;
+    (void) sink;
+    return (wtime() - start) / N;
+}
+
+/* same, with the vector implementation */
+template<typename Problem>
+double vector_eval_time(const Problem& pb, double duration)
+{
+    constexpr int vlen = Problem::vlen;
+    u64 x[vlen] __attribute__ ((aligned(sizeof(u64) * vlen))); 
+    u64 z[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+    bool choice[vlen];
+    for (int i = 0; i < vlen; i++) {
+        choice[i] = i & 1;
+        x[i] = i;
+    }
+    u64 mask = make_mask(pb.n);
+    u64 N = 0;
+    double start = wtime();
+    do {
+        for (int k = 0; k < 64; k++) {
+            pb.vfg(x, choice, z);
+            for (int j = 0; j < vlen; j++)
+                x[j] = z[j] & mask;
+        }
+        N += 64 * vlen;
+    } while (wtime() - start < duration);
+    volatile u64 sink = x[0];
+    (void) sink;
+    return (wtime() - start) / N;
+}
+
+inline void display_stats(double rate, const MpiParameters &params)
 {
-	double rate = vlen * N / (wtime() - start);
     double rate_min = rate;
     double rate_max = rate;
     double rate_avg = rate;
@@ -396,46 +1065,110 @@ void benchmark(const Problem& pb, const MpiParameters &params)
         printf("Benchmarking scalar implementation (using %d processes)\n", params.size);
 
     MPI_Barrier(params.world_comm);
-
-    u64 N = 1ull << 26; 
-    double start = wtime();
-    u64 count = 0;
-    for (u64 x = 0; x < N; x++) {
-        u64 z = (x & 1) ? pb.f(x) : pb.g(x);
-        u64 hash = (z * 0xdeadbeef) % 0x7fffffff;
-        int target = ((int) hash) % params.n_recv;
-        if (target == 0)
-            count += 1;
-    }
-    display_stats(N, start, 1, params);
+    display_stats(1 / scalar_eval_time(pb, 1, params.rank), params);
 
     constexpr int vlen = Problem::vlen;
     if (vlen > 1) {
         if (params.rank == 0)
             printf("Benchmarking vector implementation (vlen=%d)\n", vlen);
+        MPI_Barrier(params.world_comm);
+        display_stats(1 / vector_eval_time(pb, 1), params);
+    }
+}
 
-        u64 x[vlen] __attribute__ ((aligned(sizeof(u64) * vlen))); 
-        u64 z[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
-        bool choice[vlen];
-        for (int i = 0; i < vlen; i++) {
-        	choice[i] = i & 1;
-            x[i] = i;
-        }
 
-		MPI_Barrier(params.world_comm);
 
-        double start = wtime();
-        u64 mask = make_mask(pb.n);
-        u64 N = 1ull << 20; 
-        for (u64 i = 0; i < N; i++) {
-            pb.vfg(x, choice, z);
-            for (int j = 0; j < vlen; j++)
-                x[j] = z[j] & mask;
-        }
-        display_stats(N, start, vlen, params);
-    }
-}
+/*
+ * Startup calibration of recv_per_node and buffer_capacity, for this problem on this hardware.
+ * Senders pay 1/theta evaluations of the vector implementation per DP.  Receivers pay a dict
+ * probe per DP, plus the walks after collisions with the scalar implementation (cf. below).  
+ * Both sides should keep up with each other.  Collective over `comm`; call this before setup().
+ */
+template<typename Problem>
+void calibrate(const Problem& pb, MpiParameters &params, MPI_Comm comm)
+{
+	int rank, size, node_size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	MPI_Comm node_comm = params.detect_nodes(comm);
+	MPI_Comm_size(node_comm, &node_size);
+	MPI_Comm_free(&node_comm);
+	if (params.nbytes_memory == 0)
+		errx(1, "the amount of RAM to use (per node) must be specified");
+	if (node_size < (params.dedicated_controller ? 3 : 2))
+		errx(1, "MPI: ERROR! Calibration needs at least one sender and one receiver per node");
+
+	/* time per evaluation (scalar, vector), then per dict probe.  Each for about 0.2s */
+	double t[3];
+	t[0] = scalar_eval_time(pb, 0.2, rank);
+	t[1] = vector_eval_time(pb, 0.2);
+
+	/* a dict of about the size each receiver will have (if half of the processes are receivers) */
+	u64 w = PcsDict::get_nslots(params.nbytes_memory * params.n_nodes, 1);
+	PcsDict dict(28, std::max<u64>(1 << 16, 2 * w / size));
+	u64 x = rank;
+	u64 N = 0;
+	double start = wtime();
+	do {
+		for (int k = 0; k < 1024; k++) {
+			x = x * 0x2545f4914f6cdd1dull + 1;
+			auto probe = dict.pop_insert(x >> 20, x & 0xfffffff, k);
+			if (probe)
+				x ^= probe->first;
+		}
+		N += 1024;
+	} while (wtime() - start < 0.2);
+	t[2] = (wtime() - start) / N;
+	volatile u64 sink = x;
+	(void) sink;
+	MPI_Allreduce(MPI_IN_PLACE, t, 3, MPI_DOUBLE, MPI_SUM, comm);
+	for (int k = 0; k < 3; k++)
+		t[k] /= size;
+
+	/* cost of a DP on each side.  Then split the processes of each node so that both sides keep up */
+	double theta = (params.theta > 0) ? params.theta : std::min(1., params.optimal_theta(w, pb.n));
+	double send_cost = t[1] / theta;
+
+	/* 
+	 * Walks per DP on the receiver side.  A new trail (1/theta points) meets one of the w/theta points 
+	 * of a full dict with probability w / theta^2 / 2^n (1 / alpha^2 with the optimal theta), and the
+	 * dict is full during a fraction 1 - 1/(2*beta) of the beta*w DPs of a version.  Locating the 
+	 * collision then walks both trails again: 2/theta evaluations.
+	 */
+	double p_collision = std::min(1., w / (theta * theta * std::pow(2., pb.n)));
+	double walks_per_dp = (1 - 0.5 / params.beta) * p_collision * 2 / theta;
+	double recv_cost = t[2] + walks_per_dp * t[0];
+	int workers = node_size - (params.dedicated_controller ? 1 : 0);     // (on the node of the controller)
+	int R = std::llround(workers * recv_cost / (send_cost + recv_cost));
+	R = std::clamp(R, 1, workers - 1);
+	int S = workers - R;
+	params.recv_per_node = R;
+
+	double production = S / send_cost;         // #DP/s on each node
+	double capacity = R / recv_cost;
+	double send_util = std::min(1., capacity / production);
+	double recv_util = std::min(1., production / capacity);
+
+	/* 
+	 * A sender should fill the buffer of each receiver in about 10ms, as long as all the buffers 
+	 * (cf. the controller) fit in 1/8 of the RAM.
+	 */
+	double pair_rate = send_util / send_cost / (R * params.n_nodes);
+	u64 nbuf = 1 + params.buffer_depth + params.max_backlog;
+	u64 nslots_node = nbuf * S * R * params.n_nodes + 2 * params.recv_pool * R;
+	double fit = params.nbytes_memory / 8. / (3 * sizeof(u64) * nslots_node);
+	params.buffer_capacity = std::clamp<double>(std::min(0.01 * pair_rate, fit), 64, 1 << 16);
 
+	if (rank == 0) {
+		char hscalar[8], hvector[8], hdict[8];
+		human_format(1 / t[0], hscalar);
+		human_format(1 / t[1], hvector);
+		human_format(1 / t[2], hdict);
+		printf("CALIBRATION: f/s == %s (scalar) / %s (vector).  Dict probes/s == %s\n", hscalar, hvector, hdict);
+		printf("CALIBRATION: setting recv_per_node == %d, buffer_capacity == %d\n", params.recv_per_node, params.buffer_capacity);
+		printf("CALIBRATION: expected utilisation: senders %.0f%%, receivers %.0f%%\n", 100 * send_util, 100 * recv_util);
+	}
+}
 
 }
 #endif
\ No newline at end of file
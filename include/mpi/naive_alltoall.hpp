@@ -17,19 +17,119 @@
 
 namespace mitm {
 
-template <bool EXPENSIVE_F, class AbstractProblem>
-vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiParameters &params)
+/* 
+ * Compute the values of this process in a round, sorted by target process (limit slots each).
+ * round = [N * round / nrounds : N * (round + 1) / nrounds].  progress() is called from time to time.
+ */
+template <bool EXPENSIVE_F, class AbstractProblem, class Progress>
+static void alltoall_compute(AbstractProblem &Pb, int phase, u64 N, u64 round, u64 nrounds, int rank, int size, 
+                             int limit, u64 *sendbuffer, int *sendcounts, Progress &progress)
 {
-	static_assert(std::is_base_of<AbstractClawProblem, AbstractProblem>::value,
-		"problem not derived from mitm::AbstractClawProblem");
+	// reset sendcounts
+	for (int i = 0; i < size; i++)
+		sendcounts[i] = 0;
 
+	u64 round_lo = N * round / nrounds;
+	u64 round_hi = N * (round + 1) / nrounds;
+	u64 round_size = round_hi - round_lo;
+	u64 process_lo = round_lo + rank * round_size / size;
+	u64 process_hi = round_lo + (rank + 1) * round_size / size;
+	enumerate_fg(Pb, phase == 0, process_lo, process_hi, [&](u64 x, u64 z) {
+		if ((x & 4095) == 0)
+			progress();
+		u64 hash = (z * 0xdeadbeef) % 0x7fffffff;
+		int target = ((int) hash) % size;
+		assert(sendcounts[target] < limit);
+		u64 offset = limit * target + sendcounts[target];
+		if (EXPENSIVE_F) {
+			sendbuffer[offset] = x;
+			sendbuffer[offset + 1] = z;
+			sendcounts[target] += 2;
+		} else {
+			sendbuffer[offset] = x;
+			sendcounts[target] += 1;
+		}
+	});
+}
+
+/* 
+ * Insert the received values into the dict (phase 0) or probe the dict with them (phase 1).
+ * progress() is called before each incoming buffer.
+ */
+template <bool EXPENSIVE_F, class AbstractProblem, class Dict, class Progress>
+static void alltoall_process(AbstractProblem &Pb, int phase, Dict &dict, int size, int limit, 
+                             const u64 *recvbuffer, const int *recvcounts, 
+                             u64 &probe_false_pos, vector<pair<u64, u64>> &result, Progress &progress)
+{
+	vector<u64> xs, zs;     // the values of a buffer, processed in a batch
+	vector<u64> ys, yz;     // (phase 1) what the dict returned, and the value it was probed with
+	vector<size_t> yk;      // ... the index of that probe
+	for (int i = 0; i < size; i++) {
+		progress();
+		xs.clear();
+		zs.clear();
+		for (int j = 0; j < recvcounts[i]; j++) {
+			xs.push_back(recvbuffer[i * limit + j]);
+			if (EXPENSIVE_F) {
+				j += 1;
+				zs.push_back(recvbuffer[i * limit + j]);
+			}
+		}
+		if (not EXPENSIVE_F) {
+			zs.resize(xs.size());
+			batch_fg(Pb, phase == 0, xs.data(), zs.data(), xs.size());
+		}
+		if (phase == 0) {
+			// inject data into dict
+			for (size_t k = 0; k < xs.size(); k++)
+				dict.insert(zs[k], xs[k]);
+			continue;
+		}
+		// probe dict
+		ys.clear();
+		yz.clear();
+		yk.clear();
+		dict.probe_many(zs.data(), zs.size(), [&](size_t k, u64 y) {
+			ys.push_back(y);
+			yz.push_back(zs[k]);
+			yk.push_back(k);
+		});
+		// weed out the false positives from truncation in the hash table
+		probe_false_pos += ys.size();
+		check_f(Pb, ys.data(), yz.data(), ys.size(), [&](size_t c) {
+			probe_false_pos -= 1;
+			u64 y = ys[c];
+			u64 x = xs[yk[c]];
+			if (Pb.is_good_pair(y, x))
+				result.push_back(pair(y, x));
+		});
+	}
+}
+
+static void alltoall_display(u64 round, u64 nrounds, u64 K, double phase_start, double wait, double &last_display)
+{
+	double now = wtime();
+	if (now - last_display < 0.5)
+		return;
+	char frate[8], nrate[8];
+	double delta = now - phase_start;
+	last_display = now;
+	human_format(K * (round + 1) / delta, frate);
+	human_format(8 * K * (round + 1) / delta, nrate);
+	printf("Round %" PRId64 " / %" PRId64 ".  Wait/round = %.3fs (%.1f%%).  %s f()/s.  Net=%sB/s\n",
+	   round, nrounds, wait/(1+round), 100.*wait / delta, frate, nrate);
+	fflush(stdout);
+}
+
+template <bool EXPENSIVE_F, class AbstractProblem, class Dict>
+vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiParameters &params, Dict &dict)
+{
 	int rank, size;
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &size);
 
 	double start = wtime();
 	u64 N = 1ull << Pb.n;
-	CompactDict dict((1.25 * N) / size);
 	vector<pair<u64, u64>> result;
 
     // expected #values received in each round by each process
@@ -44,7 +144,6 @@ vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiPa
 	//     printf("limit=%d\n", limit);
 
 	u64 probe_false_pos = 0;
-	u64 keys[3 * Pb.n];
 	vector<u64> sendbuffer(size * limit);
 	vector<u64> recvbuffer(size * limit);
 	vector<int> sendcounts(size);
@@ -52,13 +151,14 @@ vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiPa
 	vector<int> displs(size);
 	for (int i = 0; i < size; i++)
 		displs[i] = limit * i;
+	auto no_progress = []() {};
 
 	if (params.verbose) {
 		char hbsize[8], hdsize[8];
 		u64 bsize_process = 2 * sizeof(u64) * size * limit;
 		u64 rank_per_node = size / params.n_nodes;
 		human_format(bsize_process * rank_per_node, hbsize);
-		u64 dsize_process = dict.n_slots * (sizeof(u64) + sizeof(u32));
+		u64 dsize_process = dict.n_slots * dict.bytes_per_slot();
 		human_format(dsize_process * rank_per_node, hdsize);
 		printf("RAM per node == %sB buffer + %sB dict\n", hbsize, hdsize);
 	}
@@ -74,84 +174,154 @@ vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiPa
 
 		const u64 nrounds = (N + K - 1) / K;
 		for (u64 round = 0; round < nrounds; round ++) {
-			// reset sendcounts
-			for (int i = 0; i < size; i++)
-				sendcounts[i] = 0;
-
-			// round = [N * round / nrounds : N * (round + 1) / nrounds]
-			u64 round_lo = N * round / nrounds;
-			u64 round_hi = N * (round + 1) / nrounds;
-			u64 round_size = round_hi - round_lo;
-			u64 process_lo = round_lo + rank * round_size / size;
-			u64 process_hi = round_lo + (rank + 1) * round_size / size;
-			for (u64 x = process_lo; x < process_hi; x++) {
-				u64 z = (phase == 0) ? Pb.f(x) : Pb.g(x);
-				u64 hash = (z * 0xdeadbeef) % 0x7fffffff;
-				int target = ((int) hash) % size;
-				assert(sendcounts[target] < limit);
-				u64 offset = limit * target + sendcounts[target];
-				if (EXPENSIVE_F) {
-					sendbuffer[offset] = x;
-					sendbuffer[offset + 1] = z;
-					sendcounts[target] += 2;
-				} else {
-					sendbuffer[offset] = x;
-					sendcounts[target] += 1;
-				}
-			}
+			alltoall_compute<EXPENSIVE_F>(Pb, phase, N, round, nrounds, rank, size, limit, 
+			                              sendbuffer.data(), sendcounts.data(), no_progress);
 			double start_comm = wtime();
 
 			// exchange buffer sizes;
 			MPI_Alltoall(sendcounts.data(), 1, MPI_INT, recvcounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
 
-			// exchange data / TODO: IAlltoallv
+			// exchange data (cf. the pipelined version below)
 			MPI_Alltoallv(sendbuffer.data(), sendcounts.data(), displs.data(), MPI_UINT64_T, 
 					  recvbuffer.data(), recvcounts.data(), displs.data(), MPI_UINT64_T, MPI_COMM_WORLD);
 
 			wait += wtime() - start_comm;
 
-			for (int i = 0; i < size; i++)
-				for (int j = 0; j < recvcounts[i]; j++) {
-					u64 x = recvbuffer[i * limit + j];
-					u64 z;
-					if (EXPENSIVE_F) {
-						j += 1;
-						z = recvbuffer[i * limit + j];
-					} else {
-						z = (phase == 0) ? Pb.f(x) : Pb.g(x);
-					}
-					if (phase == 0) {
-						// inject data into dict
-						dict.insert(z, x);
-					} else {
-						// probe dict
-						int nkeys = dict.probe(z, keys);
-						for (int k = 0; k < nkeys; k++) {
-							u64 y = keys[k];
-							if (z != Pb.f(y)) {
-								probe_false_pos += 1;
-								continue;    // false positive from truncation in the hash table
-							}
-							if (Pb.is_good_pair(y, x)) {
-								// printf("\nfound golden collision !!!\n");
-								result.push_back(pair(y, x));
-							}
-						}
-					}
-				}
+			alltoall_process<EXPENSIVE_F>(Pb, phase, dict, size, limit, recvbuffer.data(), recvcounts.data(), 
+			                              probe_false_pos, result, no_progress);
 
 			// verbosity
-			double now = wtime();
-			if (rank == 0 && now - last_display >= 0.5) {
-				char frate[8], nrate[8];
-				double delta = now - phase_start;
-				last_display = now;
-				human_format(K * (round + 1) / delta, frate);
-				human_format(8 * K * (round + 1) / delta, nrate);
-				printf("Round %" PRId64 " / %" PRId64 ".  Wait/round = %.3fs (%.1f%%).  %s f()/s.  Net=%sB/s\n",
-				   round, nrounds, wait/(1+round), 100.*wait / delta, frate, nrate);
-				fflush(stdout);
+			if (rank == 0)
+				alltoall_display(round, nrounds, K, phase_start, wait, last_display);
+		} //  round
+		if (rank == 0)
+			printf("Phase: %.1fs\n", wtime() - phase_start);
+	} // phase
+	if (rank == 0)
+		printf("Total: %.1fs\n", wtime() - start);
+	BCast_result(params, result);
+	return result;
+}
+
+/* the dict holds (f(x), x), with a compact encoding if params.fingerprint_bits > 0 */
+template <bool EXPENSIVE_F, class AbstractProblem>
+vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiParameters &params)
+{
+	static_assert(std::is_base_of<AbstractClawProblem, AbstractProblem>::value,
+		"problem not derived from mitm::AbstractClawProblem");
+
+	int size;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	u64 n_slots = (1.25 * (1ull << Pb.n)) / size;
+	return with_claw_dict(n_slots, Pb.n, params.fingerprint_bits, [&](auto &dict) {
+		return naive_mpi_claw_search_alltoall<EXPENSIVE_F>(Pb, params, dict);
+	});
+}
+
+
+/*
+ * Same thing, with the communications in the background.  Send and receive areas are doubled:
+ * the values of round r+1 are computed while those of round r are in flight (MPI_Ialltoallv), 
+ * and the values of round r are processed while those of round r+1 are in flight.  Only the 
+ * (small) exchange of the counts of the next round is waited for in between.
+ */
+template <bool EXPENSIVE_F, class AbstractProblem, class Dict>
+vector<pair<u64, u64>> naive_mpi_claw_search_alltoall_pipelined(AbstractProblem &Pb, MpiParameters &params, Dict &dict)
+{
+	int rank, size;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	double start = wtime();
+	u64 N = 1ull << Pb.n;
+	vector<pair<u64, u64>> result;
+
+	// same rounds as above
+	const u64 alpha = params.buffer_capacity;
+	const u64 K = alpha*size;
+	int limit = alpha + std::sqrt(120 * alpha);
+
+	u64 probe_false_pos = 0;
+	vector<u64> sendbuffer[2], recvbuffer[2];
+	vector<int> sendcounts[2], recvcounts[2];
+	for (int s = 0; s < 2; s++) {
+		sendbuffer[s].resize(size * limit);
+		recvbuffer[s].resize(size * limit);
+		sendcounts[s].resize(size);
+		recvcounts[s].resize(size);
+	}
+	vector<int> displs(size);
+	for (int i = 0; i < size; i++)
+		displs[i] = limit * i;
+	MPI_Request counts_request = MPI_REQUEST_NULL;
+	MPI_Request data_request = MPI_REQUEST_NULL;
+
+	/* most MPI implementations only move the collectives forward while we are inside MPI */
+	auto progress = [&]() {
+		int flag;
+		MPI_Test(&data_request, &flag, MPI_STATUS_IGNORE);
+	};
+
+	if (params.verbose) {
+		char hbsize[8], hdsize[8];
+		u64 bsize_process = 4 * sizeof(u64) * size * limit;
+		u64 rank_per_node = size / params.n_nodes;
+		human_format(bsize_process * rank_per_node, hbsize);
+		u64 dsize_process = dict.n_slots * dict.bytes_per_slot();
+		human_format(dsize_process * rank_per_node, hdsize);
+		printf("RAM per node == %sB buffer + %sB dict\n", hbsize, hdsize);
+	}
+
+	for (int phase = 0; phase < 2; phase++) {
+		// phase 0 == fill the dict with f()
+		// phase 1 == probe the dict with g()
+		if (rank == 0)
+			printf("Starting phase %d (pipelined)\n", phase);
+		double phase_start = wtime();
+		double last_display = phase_start;
+		double wait = 0;
+
+		/* round r uses the buffers of slot r % 2.  Start the first one */
+		auto start_counts = [&](int s) {
+			MPI_Ialltoall(sendcounts[s].data(), 1, MPI_INT, recvcounts[s].data(), 1, MPI_INT, MPI_COMM_WORLD, &counts_request);
+		};
+		auto start_data = [&](int s) {
+			double start_comm = wtime();
+			MPI_Wait(&counts_request, MPI_STATUS_IGNORE);
+			wait += wtime() - start_comm;
+			MPI_Ialltoallv(sendbuffer[s].data(), sendcounts[s].data(), displs.data(), MPI_UINT64_T, 
+					  recvbuffer[s].data(), recvcounts[s].data(), displs.data(), MPI_UINT64_T, MPI_COMM_WORLD, &data_request);
+		};
+
+		const u64 nrounds = (N + K - 1) / K;
+		alltoall_compute<EXPENSIVE_F>(Pb, phase, N, 0, nrounds, rank, size, limit, 
+		                              sendbuffer[0].data(), sendcounts[0].data(), progress);
+		start_counts(0);
+		start_data(0);
+		for (u64 round = 0; round < nrounds; round ++) {
+			int s = round % 2;
+			bool more = (round + 1 < nrounds);
+
+			/* the buffers of the other slot are free: round - 1 is over */
+			if (more) {
+				alltoall_compute<EXPENSIVE_F>(Pb, phase, N, round + 1, nrounds, rank, size, limit, 
+				                              sendbuffer[s ^ 1].data(), sendcounts[s ^ 1].data(), progress);
+				start_counts(s ^ 1);
 			}
+
+			double start_comm = wtime();
+			MPI_Wait(&data_request, MPI_STATUS_IGNORE);
+			wait += wtime() - start_comm;
+
+			if (more)
+				start_data(s ^ 1);
+
+			alltoall_process<EXPENSIVE_F>(Pb, phase, dict, size, limit, recvbuffer[s].data(), recvcounts[s].data(), 
+			                              probe_false_pos, result, progress);
+
+			// verbosity
+			if (rank == 0)
+				alltoall_display(round, nrounds, K, phase_start, wait, last_display);
 		} //  round
 		if (rank == 0)
 			printf("Phase: %.1fs\n", wtime() - phase_start);
@@ -162,6 +332,21 @@ vector<pair<u64, u64>> naive_mpi_claw_search_alltoall(AbstractProblem &Pb, MpiPa
 	return result;
 }
 
+/* the dict holds (f(x), x), with a compact encoding if params.fingerprint_bits > 0 */
+template <bool EXPENSIVE_F, class AbstractProblem>
+vector<pair<u64, u64>> naive_mpi_claw_search_alltoall_pipelined(AbstractProblem &Pb, MpiParameters &params)
+{
+	static_assert(std::is_base_of<AbstractClawProblem, AbstractProblem>::value,
+		"problem not derived from mitm::AbstractClawProblem");
+
+	int size;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	u64 n_slots = (1.25 * (1ull << Pb.n)) / size;
+	return with_claw_dict(n_slots, Pb.n, params.fingerprint_bits, [&](auto &dict) {
+		return naive_mpi_claw_search_alltoall_pipelined<EXPENSIVE_F>(Pb, params, dict);
+	});
+}
+
 }
 
 #endif
@@ -8,6 +8,8 @@
 #include "problem.hpp"
 #include "mpi/common.hpp"
 #include "dict.hpp"
+#include "mpi/prefilter.hpp"
+#include "external.hpp"
 
 #include <mpi.h>
 
@@ -17,133 +19,355 @@
 
 namespace mitm {
 
-template <bool EXPENSIVE_F, class Problem>
-vector<pair<u64, u64>> naive_mpi_claw_search_isend(const Problem &pb, MpiParameters &params)
+/* #pairs in a sorted run of a receiver, in external mode */
+inline u64 external_capacity(const MpiParameters &params)
 {
-    static_assert(std::is_base_of<AbstractClawProblem, Problem>::value,
-        "problem not derived from mitm::AbstractClawProblem");
+    if (params.nbytes_memory == 0)
+        return 1 << 22;
+    return params.nbytes_memory / params.recv_per_node / (2 * 2 * sizeof(u64));
+}
+
+/* where a receiver saves its part of the dict (params.dict_file) */
+inline std::string dict_shard_path(const MpiParameters &params)
+{
+    return params.dict_file + "." + std::to_string(params.local_rank) + "-of-" + std::to_string(params.n_recv);
+}
 
+/* identifies the part of the dict of a receiver: it depends on f and on the receiver */
+template <class Problem>
+u64 dict_shard_tag(const Problem &pb, const MpiParameters &params)
+{
+    u64 h = murmur64(pb.n ^ ((u64) pb.m << 8) ^ ((u64) params.n_recv << 16) ^ ((u64) params.local_rank << 40));
+    for (u64 x = 0; x < 4; x++)
+        h = murmur128(h, pb.f(x & make_mask(pb.n)));
+    return h;
+}
+
+/* 
+ * Several targets that share f (but not g) at once: the dict is built once, then phase 1 goes 
+ * over the domain once and evaluates all the g's.  Values sent to the receivers carry the index 
+ * of their target above the first n bits.  Returns the claws of each target.
+ *
+ * With passes > 1, the search is done in that many passes; each one only stores and probes the 
+ * f(x) and g(x) of its slice (cf. slice_of()), in a dict sized for 1 / passes of them.
+ * If prebuilt, the dict is already there (cf. params.dict_file) and phase 0 is skipped.
+ */
+template <bool EXPENSIVE_F, class Problem, class Dict>
+vector<vector<pair<u64, u64>>> naive_mpi_claw_search_isend_multi(const vector<Problem> &targets, MpiParameters &params, 
+                                                                 Dict &dict, u64 passes = 1, bool prebuilt = false)
+{
     double start = wtime();
+    const Problem &pb = targets[0];
     u64 N = 1ull << pb.n;
-    vector<pair<u64, u64>> result;
-    CompactDict dict((params.role == RECEIVER) ? (1.5 * N) / params.n_recv : 0);
+    u64 n_targets = targets.size();
+    u64 x_mask = make_mask(pb.n);
+    if (n_targets > 1 && (pb.n >= 64 || ((n_targets - 1) >> (64 - pb.n)) != 0))
+        errx(1, "%" PRIu64 " targets do not fit next to %d-bit values", n_targets, pb.n);
+    vector<vector<pair<u64, u64>>> result(n_targets);
 
     if (params.verbose) {
         printf("Claw-finding: {0,1}^%d --> {0,1}^%d\n", pb.n, pb.m);
         char hbsize[8], hdsize[8];
-        u64 bsize_node = 4 * sizeof(u64) * params.buffer_capacity * params.n_send * params.n_recv / params.n_nodes;
+        // senders: up to 1 + depth + backlog buffers / receiver.  Receivers: a pool of buffers
+        int nbuf = 1 + params.buffer_depth + params.max_backlog;
+        u64 bsize_node = sizeof(u64) * params.buffer_capacity * (nbuf * params.n_send + params.recv_pool) * params.n_recv / params.n_nodes;
         human_format(bsize_node, hbsize);
-        u64 dsize_node = (1.25 * N) / params.n_recv * (sizeof(u64) + sizeof(u32)) * params.recv_per_node;
+        u64 dsize_node = (1.5 * N) / params.n_recv / passes * dict.bytes_per_slot() * params.recv_per_node;
         human_format(dsize_node, hdsize);
         printf("RAM per node == %sB buffer + %sB dict\n", hbsize, hdsize);
+        if (passes > 1)
+            printf("%" PRIu64 " passes\n", passes);
+        if (n_targets > 1)
+            printf("%" PRIu64 " targets\n", n_targets);
+        if (not params.external_dir.empty())
+            printf("External mode: sorted runs of %" PRIu64 " pairs in %s\n", external_capacity(params), params.external_dir.c_str());
+    }
+
+    /*
+     * Optional external mode: receivers write (f(x), x) then (g(x), x) to sorted runs on disk 
+     * instead of using the dict, and merge-join both at the end.  The keys are only stored if
+     * they are expensive to recompute.
+     */
+    if (passes > 1 && not params.external_dir.empty())
+        errx(1, "the external mode is done in a single pass");
+    if (n_targets > 1 && not params.external_dir.empty())
+        errx(1, "the external mode handles a single target");
+    optional<SortedRuns> runs_f, runs_g;
+    if (not params.external_dir.empty() && params.role == RECEIVER) {
+        std::string prefix = params.external_dir + "/mitm-" + std::to_string(params.rank);
+        runs_f.emplace(prefix + "-f.runs", external_capacity(params), EXPENSIVE_F);
+        runs_g.emplace(prefix + "-g.runs", external_capacity(params), EXPENSIVE_F);
     }
 
-    u64 ncoll = 0;
-    for (int phase = 0; phase < 2; phase++) {
-        // phase 0 == fill the dict with f()
-        // phase 1 == probe the dict with g()
-        if (params.verbose)
-            printf("Starting phase %d\n", phase);
-
-        double phase_start = wtime();        
-        double wait;
-
-        if (params.role == SENDER) {
-            SendBuffers sendbuf(params.inter_comm, TAG_POINTS, params.buffer_capacity);
-            u64 lo = params.local_rank * N / params.n_send;
-            u64 hi = (params.local_rank + 1) * N / params.n_send;
-            for (u64 x = lo; x < hi; x++) {
-                u64 z = (phase == 0) ? pb.f(x) : pb.g(x);
-                u64 hash = (z * 0xdeadbeef) % 0x7fffffff;
-                int target = ((int) hash) % params.n_recv;
-                if (EXPENSIVE_F)
-                    sendbuf.push2(x, z, target);
-                else
-                    sendbuf.push(x, target);
+    /* 
+     * Optional prefilter: in phase 0, receivers also build a Bloom filter of what they store.  
+     * Then senders only send the g(x) that may be in the dict of their receiver.
+     */
+    vector<u64> own_filter;
+    u64 filter_words = BloomFilter::n_words_for(N / params.n_recv / passes, params.prefilter_bits);
+    optional<ReplicatedFilter> filter;
+
+    u64 ncoll = 0, ncoll_total = 0;
+    for (u64 pass = 0; pass < passes; pass++) {
+        if (pass > 0)
+            dict.clear();
+        filter.reset();
+        if (params.prefilter_bits > 0 && params.role == RECEIVER)
+            own_filter.assign(filter_words, 0);
+        BloomFilter bloom(own_filter.data(), filter_words, params.prefilter_bits);
+        ncoll = 0;
+
+        for (int phase = prebuilt ? 1 : 0; phase < 2; phase++) {
+            // phase 0 == fill the dict with f()
+            // phase 1 == probe the dict with g()
+            if (params.verbose)
+                printf("Starting pass %" PRIu64 ", phase %d\n", pass, phase);
+
+            if (phase == 1 && params.prefilter_bits > 0) {
+                filter.emplace(params, own_filter, filter_words, params.prefilter_bits);
+                own_filter.clear();
+                own_filter.shrink_to_fit();
+                if (params.verbose) {
+                    char hfsize[8];
+                    human_format(filter->bytes(params), hfsize);
+                    printf("Prefilter: %sB per node, %d bits per entry\n", hfsize, params.prefilter_bits);
+                }
             }
-            sendbuf.flush();
 
-            /* aggregate stats over all senders */
-            wait = sendbuf.waiting_time;
-        }
+            double phase_start = wtime();        
+            double wait;
 
-        if (params.role == RECEIVER) {
-            RecvBuffers recvbuf(params.inter_comm, TAG_POINTS, params.buffer_capacity);
-            u64 keys[3 * pb.n];
-            while (not recvbuf.complete()) {
-                auto ready_buffers = recvbuf.wait();
-                for (auto it = ready_buffers.begin(); it != ready_buffers.end(); it++) {
-                    auto * buffer = *it;
-                    // printf("got buffer! phase=%d, size=%zd\n", phase, buffer->size());
-                    for (auto jt = buffer->begin(); jt != buffer->end(); jt++) {
-                        u64 x = *jt, z;
-                        if (EXPENSIVE_F) {
-                            jt++;
-                            z = *jt;
-                        } else {
-                            z = (phase == 0) ? pb.f(x) : pb.g(x);
-                        }
+            if (params.role == SENDER) {
+                SendBuffers sendbuf(params.inter_comm, TAG_POINTS, params.buffer_capacity, params.buffer_depth, params.max_backlog);
+                u64 lo = params.local_rank * N / params.n_send;
+                u64 hi = (params.local_rank + 1) * N / params.n_send;
+                u64 n_sent = 0, n_slice = 0;
+                u64 t;      // current target
+                auto send = [&](u64 x, u64 z) {
+                    if (passes > 1 && slice_of(z, passes) != pass)
+                        return;
+                    n_slice += 1;
+                    u64 hash = (z * 0xdeadbeef) % 0x7fffffff;
+                    int target = ((int) hash) % params.n_recv;
+                    if (filter && not filter->contains(target, z))
+                        return;
+                    n_sent += 1;
+                    x |= t << pb.n;
+                    if (EXPENSIVE_F)
+                        sendbuf.push2(x, z, target);
+                    else
+                        sendbuf.push(x, target);
+                };
+                /* phase 1 goes over the domain once, by chunks, and does all the targets on each one */
+                constexpr u64 chunk = 4096;
+                for (u64 a = lo; a < hi; a += chunk)
+                    for (t = 0; t < ((phase == 0) ? 1 : n_targets); t++)
+                        enumerate_fg(targets[t], phase == 0, a, std::min(a + chunk, hi), send);
+                sendbuf.flush();
+
+                if (filter) {
+                    u64 counts[2] = {n_sent, n_slice};
+                    MPI_Allreduce(MPI_IN_PLACE, counts, 2, MPI_UINT64_T, MPI_SUM, params.local_comm);
+                    if (params.local_rank == 0)
+                        printf("phase %d: the prefilter let %.3f%% of the values through\n", phase, 100. * counts[0] / counts[1]);
+                }
+
+                /* aggregate stats over all senders */
+                wait = sendbuf.waiting_time;
+            }
 
-                        switch (phase) {
-                        case 0:
-                            dict.insert(z, x);
-                            break;
-                        case 1: {
-                            // probe dict
-                            int nkeys = dict.probe(z, keys);
-                            for (int k = 0; k < nkeys; k++) {
-                                u64 y = keys[k];
-                                if (z != pb.f(y))
-                                    continue;    // false positive from truncation in the hash table
-                                ncoll += 1;
-                                if (pb.is_good_pair(y, x))
-                                    result.push_back(pair(y, x));
+            if (params.role == RECEIVER) {
+                RecvBuffers recvbuf(params.inter_comm, TAG_POINTS, params.buffer_capacity, params.recv_pool);
+                vector<u64> xs, zs;     // the values of a buffer, processed in a batch
+                vector<u64> ts;         // ... their targets (phase 1)
+                vector<u64> sub_x, sub_z;
+                vector<size_t> sub_k;
+                vector<u64> ys, yz;     // (phase 1) what the dict returned, and the value it was probed with
+                vector<size_t> yk;      // ... the index of that probe
+                while (not recvbuf.complete()) {
+                    auto &ready_buffers = recvbuf.wait();
+                    for (auto it = ready_buffers.begin(); it != ready_buffers.end(); it++) {
+                        auto * buffer = *it;
+                        // printf("got buffer! phase=%d, size=%zd\n", phase, buffer->size());
+                        xs.clear();
+                        zs.clear();
+                        ts.clear();
+                        for (auto jt = buffer->begin(); jt != buffer->end(); jt++) {
+                            xs.push_back(*jt & x_mask);
+                            ts.push_back(*jt >> pb.n);
+                            if (EXPENSIVE_F) {
+                                jt++;
+                                zs.push_back(*jt);
                             }
                         }
+                        if (not EXPENSIVE_F) {
+                            zs.resize(xs.size());
+                            if (phase == 0 || n_targets == 1) {
+                                batch_fg(pb, phase == 0, xs.data(), zs.data(), xs.size());
+                            } else {
+                                /* one batch per target */
+                                for (u64 t = 0; t < n_targets; t++) {
+                                    sub_x.clear();
+                                    sub_k.clear();
+                                    for (size_t k = 0; k < xs.size(); k++)
+                                        if (ts[k] == t) {
+                                            sub_x.push_back(xs[k]);
+                                            sub_k.push_back(k);
+                                        }
+                                    sub_z.resize(sub_x.size());
+                                    batch_fg(targets[t], false, sub_x.data(), sub_z.data(), sub_x.size());
+                                    for (size_t j = 0; j < sub_k.size(); j++)
+                                        zs[sub_k[j]] = sub_z[j];
+                                }
+                            }
+                        }
+
+                        if (phase == 0 && params.prefilter_bits > 0)
+                            for (u64 z : zs)
+                                bloom.insert(z);
+                        if (runs_f) {
+                            auto &runs = (phase == 0) ? runs_f : runs_g;
+                            for (size_t k = 0; k < xs.size(); k++)
+                                runs->add(zs[k], xs[k]);
+                            continue;
+                        }
+                        if (phase == 0) {
+                            for (size_t k = 0; k < xs.size(); k++)
+                                dict.insert(zs[k], xs[k]);
+                            continue;
                         }
+
+                        // probe dict
+                        ys.clear();
+                        yz.clear();
+                        yk.clear();
+                        dict.probe_many(zs.data(), zs.size(), [&](size_t k, u64 y) {
+                            ys.push_back(y);
+                            yz.push_back(zs[k]);
+                            yk.push_back(k);
+                        });
+                        // weed out the false positives from truncation in the hash table
+                        check_f(pb, ys.data(), yz.data(), ys.size(), [&](size_t c) {
+                            u64 y = ys[c];
+                            u64 x = xs[yk[c]];
+                            u64 t = ts[yk[c]];
+                            ncoll += 1;
+                            if (targets[t].is_good_pair(y, x))
+                                result[t].push_back(pair(y, x));
+                        });
                     }
                 }
-            }
-            wait = recvbuf.waiting_time;
-        } // RECEIVER
-
-        // timing
-        MPI_Barrier(MPI_COMM_WORLD);
-        double delta = wtime() - phase_start;
-        double wait_min = wait;
-        double wait_max = wait;
-        double wait_avg = wait;
-        MPI_Allreduce(MPI_IN_PLACE, &wait_min, 1, MPI_DOUBLE, MPI_MIN, params.local_comm);
-        MPI_Allreduce(MPI_IN_PLACE, &wait_max, 1, MPI_DOUBLE, MPI_MAX, params.local_comm);
-        MPI_Allreduce(MPI_IN_PLACE, &wait_avg, 1, MPI_DOUBLE, MPI_SUM, params.local_comm);
-        wait_avg /= params.local_size;
-        double wait_std = (wait - wait_avg) * (wait - wait_avg);
-        MPI_Allreduce(MPI_IN_PLACE, &wait_std, 1, MPI_DOUBLE, MPI_SUM, params.local_comm);
-        MPI_Allreduce(MPI_IN_PLACE, &ncoll, 1, MPI_UINT64_T, MPI_SUM, params.world_comm);
-        wait_std = std::sqrt(wait_std);
-        if (params.local_rank == 0) {
-            printf("phase %d %s, wait min %.2fs max %.2fs avg %.2fs (%.1f%%) std %.2fs.\n",
-                phase, (params.role == SENDER) ? "sender" : "receiver", wait_min, wait_max, wait_avg, 100*wait_avg/delta, wait_std);
-        }
-        if (params.verbose) {
-            double outgoing_fraction = 1. - ((double) params.recv_per_node) / params.n_recv;
-            double volume = sizeof(u64) * N / params.n_nodes * outgoing_fraction;  // outgoing bytes per node
-            char frate[8], nrate[8];
+                wait = recvbuf.waiting_time;
+
+                if (phase == 1 && runs_f) {
+                    runs_f->close();
+                    runs_g->close();
+                    if (params.verbose)
+                        printf("Merging %zd + %zd runs\n", runs_f->n_runs(), runs_g->n_runs());
+                    auto f = [&pb](const u64 *y, u64 *z, size_t n) { batch_fg(pb, true, y, z, n); };
+                    auto g = [&pb](const u64 *x, u64 *z, size_t n) { batch_fg(pb, false, x, z, n); };
+                    merge_join(*runs_f, *runs_g, f, g, [&](u64 y, u64 x) {
+                        ncoll += 1;
+                        if (pb.is_good_pair(y, x))
+                            result[0].push_back(pair(y, x));
+                    });
+                }
+                if (phase == 0 && not params.dict_file.empty()) {
+                    if constexpr (std::is_same_v<Dict, CompactDict>)
+                        dict.save(dict_shard_path(params), dict_shard_tag(pb, params));
+                    else
+                        errx(1, "only the CompactDict can be saved");
+                }
+            } // RECEIVER
+
+            // timing
+            MPI_Barrier(MPI_COMM_WORLD);
             double delta = wtime() - phase_start;
-            human_format(N / params.n_send / delta, frate);
-            human_format(volume / delta, nrate);
-            printf("phase %d: %.1fs.  %s f/s per process, %sB/s outgoing per node. 2^%.2f collisions\n", 
-                phase, delta, frate, nrate, std::log2(ncoll));
-        }
-    } // phase
+            double wait_min = wait;
+            double wait_max = wait;
+            double wait_avg = wait;
+            MPI_Allreduce(MPI_IN_PLACE, &wait_min, 1, MPI_DOUBLE, MPI_MIN, params.local_comm);
+            MPI_Allreduce(MPI_IN_PLACE, &wait_max, 1, MPI_DOUBLE, MPI_MAX, params.local_comm);
+            MPI_Allreduce(MPI_IN_PLACE, &wait_avg, 1, MPI_DOUBLE, MPI_SUM, params.local_comm);
+            wait_avg /= params.local_size;
+            double wait_std = (wait - wait_avg) * (wait - wait_avg);
+            MPI_Allreduce(MPI_IN_PLACE, &wait_std, 1, MPI_DOUBLE, MPI_SUM, params.local_comm);
+            MPI_Allreduce(MPI_IN_PLACE, &ncoll, 1, MPI_UINT64_T, MPI_SUM, params.world_comm);
+            if (phase == 1)
+                ncoll_total += ncoll;
+            wait_std = std::sqrt(wait_std);
+            if (params.local_rank == 0) {
+                printf("phase %d %s, wait min %.2fs max %.2fs avg %.2fs (%.1f%%) std %.2fs.\n",
+                    phase, (params.role == SENDER) ? "sender" : "receiver", wait_min, wait_max, wait_avg, 100*wait_avg/delta, wait_std);
+            }
+            if (params.verbose) {
+                double outgoing_fraction = 1. - ((double) params.recv_per_node) / params.n_recv;
+                double volume = sizeof(u64) * N / params.n_nodes * outgoing_fraction;  // outgoing bytes per node
+                char frate[8], nrate[8];
+                double delta = wtime() - phase_start;
+                human_format(N / params.n_send / delta, frate);
+                human_format(volume / delta, nrate);
+                printf("phase %d: %.1fs.  %s f/s per process, %sB/s outgoing per node. 2^%.2f collisions\n", 
+                    phase, delta, frate, nrate, std::log2(ncoll));
+            }
+        } // phase
+    } // pass
 
     if (params.verbose)
-        printf("Total: %.1fs\n", wtime() - start);
+        printf("Total: %.1fs, 2^%.2f collisions\n", wtime() - start, std::log2(ncoll_total));
     
-    BCast_result(params, result);
+    for (auto &claws : result)
+        BCast_result(params, claws);
     return result;
 }
 
+/* 
+ * the dict of the receivers holds (f(x), x), with a compact encoding if params.fingerprint_bits > 0.
+ * If it does not fit in params.nbytes_memory (per node), the search is done in several passes.
+ * There is no dict in external mode.  With params.dict_file, the dict is saved after phase 0, and 
+ * reloaded (mapped) instead of being rebuilt next time, if all receivers find their part.
+ */
+template <bool EXPENSIVE_F, class Problem>
+vector<vector<pair<u64, u64>>> naive_mpi_claw_search_isend_multi(const vector<Problem> &targets, MpiParameters &params)
+{
+    static_assert(std::is_base_of<AbstractClawProblem, Problem>::value,
+        "problem not derived from mitm::AbstractClawProblem");
+
+    const Problem &pb = targets[0];
+    u64 N = 1ull << pb.n;
+    bool external = not params.external_dir.empty();
+    double dict_node = (1.5 * N) / params.n_recv * params.recv_per_node * claw_dict_bytes_per_slot(pb.n, params.fingerprint_bits);
+    u64 passes = external ? 1 : n_passes(dict_node, params.nbytes_memory);
+    u64 n_slots = (not external && params.role == RECEIVER) ? (1.5 * N) / params.n_recv / passes : 0;
+
+    if (not params.dict_file.empty()) {
+        if (external || passes > 1 || params.fingerprint_bits > 0 || params.prefilter_bits > 0)
+            errx(1, "the dict can only be saved when it is a CompactDict that fits in RAM, without prefilter");
+        int found = (params.role != RECEIVER) || access(dict_shard_path(params).c_str(), R_OK) == 0;
+        MPI_Allreduce(MPI_IN_PLACE, &found, 1, MPI_INT, MPI_LAND, params.world_comm);
+        if (found) {
+            if (params.verbose)
+                printf("Reusing the dict saved in %s.*\n", params.dict_file.c_str());
+            if (params.role == RECEIVER) {
+                CompactDict dict(dict_shard_path(params), dict_shard_tag(pb, params));
+                return naive_mpi_claw_search_isend_multi<EXPENSIVE_F>(targets, params, dict, 1, true);
+            }
+            CompactDict dict(0);
+            return naive_mpi_claw_search_isend_multi<EXPENSIVE_F>(targets, params, dict, 1, true);
+        }
+    }
+
+    return with_claw_dict(n_slots, pb.n, params.fingerprint_bits, [&](auto &dict) {
+        return naive_mpi_claw_search_isend_multi<EXPENSIVE_F>(targets, params, dict, passes);
+    });
+}
+
+template <bool EXPENSIVE_F, class Problem>
+vector<pair<u64, u64>> naive_mpi_claw_search_isend(const Problem &pb, MpiParameters &params)
+{
+    return naive_mpi_claw_search_isend_multi<EXPENSIVE_F>(vector<Problem>{pb}, params)[0];
+}
+
 }
 
 #endif
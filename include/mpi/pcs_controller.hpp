@@ -10,137 +10,400 @@
 
 namespace mitm {
 
-/* there is ONE controller process (of global rank 0) */
-
+/*
+ * There is ONE controller (of global rank 0).  It is either a dedicated process, or it is folded
+ * into a sender: then this sender polls it in its main loop.  When the cluster is split into
+ * groups, each group has its own controller, and the first one to find the golden collision
+ * tells the others.
+ */
 template<typename ProblemWrapper>
-tuple<u64,u64,u64> controller(const ProblemWrapper& wrapper, const MpiParameters &params, PRNG &prng)
-{
-    printf("Starting MPI collision search with seed=%016" PRIx64 " (MPI engine)\n", prng.seed);
-    
-	char hbsize[8], hdsize[8], htdsize[8];
-	u64 bsize_node = 4 * 3 * sizeof(u64) * params.buffer_capacity * params.n_send * params.n_recv / params.n_nodes;
-	human_format(bsize_node, hbsize);
-	human_format(params.nbytes_memory, hdsize);
-	human_format(params.n_nodes * params.nbytes_memory, htdsize);
-	double log2_w = std::log2(params.w);
-	printf("RAM per node == %sB buffer + %sB dict.  Total dict size == %s (2^%.2f slots)\n", hbsize, hdsize, htdsize, log2_w);
-    printf("Generating %.1f*w = %" PRId64 " = 2^%0.2f distinguished point / version\n", 
-        	params.beta, params.points_per_version, std::log2(params.points_per_version));
-
-    optional<tuple<u64,u64,u64>> solution;    /* (i, x0, x1)  */
-	u64 stop = 0;
-	u64 nround = 0;
+class Controller {
+public:
+	AbortSignal abort;
+
+private:
+	const ProblemWrapper &wrapper;
+	const MpiParameters &params;
+	PRNG &prng;
+
+	optional<tuple<u64,u64,u64>> solution;    /* (i, x0, x1)  */
+	bool stop = false;
 	u64 ndp_total = 0;
 	u64 ncoll_total = 0;
 	u64 nf_total = 0;
-	u64 mask = make_mask(wrapper.m);
-	double start = wtime();
+	u64 mask;
+	double start;
+
+	/* 
+	 * Consecutive versions overlap: as soon as enough DPs have been found for the oldest
+	 * version, its senders move on to the next one, while the others finish.  Senders
+	 * are never more than one version apart.
+	 */
+	vector<pair<u64, u64>> versions;          // (i, root_seed)
+	vector<u64> ndp;                          // #DP found for each version by all senders
+	vector<int> n_left;                       // #senders done with each version
+	vector<double> round_start, round_end;
+	vector<u64> own_neval;                    // contribution of the sender we are folded into (if any)
+	vector<double> own_wait;
+	vector<vector<double>> shares;            // of each receiver, for each version (weighted partitioning)
+	vector<double> recv_rate;                 // #DP/s each receiver can process (0 if unknown yet)
+	std::deque<VersionStats> stats;           // of the versions closed and not yet displayed
+	MPI_Request peer_request = MPI_REQUEST_NULL;   // golden collision found by another group
+	u64 peer_solution[3];
+	u64 oldest = 0;                           // oldest version in which senders remain
+	u64 nround = 0;                           // next version to display
+	int n_active_senders;
+	double last_display;
+
+	void new_version()
+	{
+		u64 i = 0, root_seed = 0;
+		/* each group takes its turn in the same sequence, so that they all try different versions */
+		for (int g = 0; g < params.n_groups; g++) {
+			u64 a = prng.rand() & mask;         /* index of families of mixing functions */
+			u64 b = prng.rand();
+			if (g == params.group_id) {
+				i = a;
+				root_seed = b;
+			}
+		}
+		versions.push_back(pair(i, root_seed));
+		ndp.push_back(0);
+		n_left.push_back(0);
+		round_start.push_back(wtime());
+		round_end.push_back(0);
+		own_neval.push_back(0);
+		own_wait.push_back(0);
+		shares.push_back(balance());
+	}
+
+	/* the shares of the receivers in the next version: in proportion to their speed (those not measured yet get the average) */
+	vector<double> balance() const
+	{
+		double total = 0;
+		int n_known = 0;
+		for (double r : recv_rate)
+			if (r > 0) {
+				total += r;
+				n_known += 1;
+			}
+		vector<double> share(params.n_recv, 1);
+		if (n_known > 0)
+			for (int t = 0; t < params.n_recv; t++)
+				share[t] = (recv_rate[t] > 0) ? recv_rate[t] : total / n_known;
+		return share;
+	}
+
+	/* everybody is done with version v: reduce its stats in the background */
+	void close_version(u64 v)
+	{
+		round_end[v] = wtime();
+		auto &vs = stats.emplace_back();
+		vs.iavg[0] = own_neval[v];
+		if (own_neval[v] > 0) {
+			vs.dmin[0] = own_wait[v];
+			vs.dmax[0] = own_wait[v];
+			vs.davg[0] = own_wait[v];
+		}
+		vs.reduce(params);
+	}
+
+	/* what should a sender that reported in version v do next? */
+	void assign(const u64 report[2], u64 assignment[3])
+	{
+		u64 v = report[1];
+		ndp[v] += report[0];
+		assignment[0] = KEEP_GOING;
+		assignment[1] = 0;
+		assignment[2] = 0;
+		if (stop) {
+			assignment[0] = STOP;
+			assignment[1] = versions.size() - 1;
+			n_active_senders -= 1;
+		} else if (v == oldest && ndp[v] >= params.points_per_version) {
+			if (v + 1 == versions.size()) {
+				/* first sender done with this version: announce the next one */
+				new_version();
+				u64 announce[3] = {versions.back().first, versions.back().second, 0};
+				for (int r : params.recv_ranks)
+					MPI_Send(announce, 3, MPI_UINT64_T, r, TAG_VERSION, params.world_comm);
+			}
+			assignment[0] = NEW_VERSION;
+			assignment[1] = versions[v + 1].first;
+			assignment[2] = versions[v + 1].second;
+			n_left[v] += 1;
+			if (n_left[v] == params.n_send) {
+				/* everybody moved on */
+				close_version(v);
+				oldest += 1;
+			}
+		}
+
+		// verbosity
+		double now = wtime();
+		if (params.verbose && now - last_display > 0.5) {
+			last_display = now;
+			double delta = now - round_start[oldest];
+			double dp_rate = ndp[oldest] / delta;
+			double nf_send_rate = dp_rate / params.theta;
+			char hsrate[8], hnrate[8];
+			human_format(nf_send_rate / params.n_send, hsrate);
+			u64 data_round = ndp[oldest] * 3 * sizeof(u64) / params.n_nodes;
+			human_format(data_round / delta, hnrate);
+			double completion = (double) ndp[oldest] / params.w / params.beta;
+			printf("\rRound %" PRId64 ":  %.1fs (%.1f%%, ETA: %.1fs).  %.2f*w #DP.  senders: %s #f/s.  Node-->%sB/s        ",
+				oldest, delta, 100. * completion, delta / completion, (double) ndp[oldest] / params.w, hsrate, hnrate);
+			fflush(stdout);
+		}
+	}
+
+	void handle(const u64 buffer[], const MPI_Status &status)
+	{
+		switch (status.MPI_TAG) {
+			case TAG_SENDER_CALLHOME: {
+				u64 assignment[3];
+				assign(buffer, assignment);
+				MPI_Send(assignment, 3, MPI_UINT64_T, status.MPI_SOURCE, TAG_ASSIGNMENT, params.world_comm);
+				if (params.weighted && assignment[0] == NEW_VERSION)
+					MPI_Send(shares[buffer[1] + 1].data(), params.n_recv, MPI_DOUBLE, status.MPI_SOURCE, TAG_PARTITION, params.world_comm);
+				break;
+			}
+
+			case TAG_RECEIVER_CALLHOME: {
+				/* (receiver, #DP/s) at the end of a version.  Smooth it a bit */
+				double &r = recv_rate[buffer[0]];
+				r = (r > 0) ? (r + buffer[1]) / 2 : buffer[1];
+				break;
+			}
+
+			case TAG_SOLUTION:
+				found(buffer, true);
+		}
+	}
+
+	/* several receivers (or groups) may report it: keep the first one */
+	void found(const u64 golden[3], bool ours)
+	{
+		if (not solution) {
+			solution = optional(tuple(golden[0], golden[1], golden[2]));
+			if (ours)
+				for (int g = 0; g < params.n_groups; g++)
+					if (g != params.group_id)
+						MPI_Send(golden, 3, MPI_UINT64_T, g, TAG_SOLUTION, params.controllers_comm);
+		}
+		if (not stop) {
+			/* no more versions: tell the receivers */
+			u64 announce[3] = {0, 0, 1};
+			for (int r : params.recv_ranks)
+				MPI_Send(announce, 3, MPI_UINT64_T, r, TAG_VERSION, params.world_comm);
+		}
+		stop = true;
+		abort.raise(params);    // senders call home right away, receivers stop processing
+	}
+
+	/* has another group found it? */
+	bool test_peers()
+	{
+		if (peer_request == MPI_REQUEST_NULL)
+			return false;
+		int flag;
+		MPI_Test(&peer_request, &flag, MPI_STATUS_IGNORE);
+		if (flag)
+			found(peer_solution, false);
+		return flag;
+	}
 
-	for (;;) {
-        u64 i = prng.rand() & mask;             /* index of families of mixing functions */
-       	u64 root_seed = prng.rand();
+	/* now is a good time to display the stats of the versions that are complete */
+	void display()
+	{
+		while (not stats.empty() && stats.front().test()) {
+			auto &vs = stats.front();
+			u64 ncoll = vs.iavg[2];
+			ndp_total += ndp[nround];
+			ncoll_total += ncoll;
+			u64 nf_send = vs.iavg[0];
+			u64 nf_recv = vs.iavg[1];
+			u64 nf_round = nf_send + nf_recv;
+			nf_total += nf_round;
+			double davg[2] = {vs.davg[0] / params.n_send, vs.davg[1] / params.n_recv};
+			double delta = round_end[nround] - round_start[nround];
 
-		/* get data from controller */
-		u64 msg[3] = {i, root_seed, stop};
+			u64 N = 1ull << wrapper.n;
+			char hsrate[8], hrrate[8], hnrate[8];
+			human_format(nf_send / params.n_send / delta, hsrate);
+			human_format(nf_recv / params.n_recv / delta, hrrate);
+			u64 data_round = ndp[nround] * 3 * sizeof(u64) / params.n_nodes;
+			human_format(data_round / delta, hnrate);
+			
+			if (params.verbose) {
+				printf("\n");
+				printf("Round %" PRId64 " (%.2f*n/w).  %.1fs.  #DP (round / total) %.2f*w / %.2f*n.  #coll (round / total) %.2f*w / %.2f*n.  Total #f=2^%.3f.  node-->%sB/s \n",
+					nround, (double) nround * params.w / N, delta, (double) ndp[nround] / params.w, (double) ndp_total / N, (double) ncoll / params.w, (double) ncoll_total / N, std::log2(nf_total), hnrate);
+				printf("Senders.    Wait == %.2fs / %.2fs (%.1f%%) / %.2fs.  #f == 2^%.2f (%.0f%%).  f/s == %s\n",
+		                vs.dmin[0], davg[0], 100. * davg[0] / delta, vs.dmax[0], std::log2(nf_send), 100. * nf_send / nf_round, hsrate);
+				printf("Receivers.  Wait == %.2fs / %.2fs (%.1f%%) / %.2fs.  #f == 2^%.2f (%.0f%%).  f/s == %s\n",
+		                vs.dmin[1], davg[1], 100. * davg[1] / delta, vs.dmax[1], std::log2(nf_recv), 100. * nf_recv / nf_round, hrrate);
+				printf("            %.2f%% probe failure.  %.2f%% walk-robinhhod.  %.2f%% walk-noncolliding.  %.2f%% same-value\n",
+		                100. * vs.iavg[3] / ndp[nround], 100. * vs.iavg[4] / ndp[nround], 100. * vs.iavg[5] / ndp[nround], 100. * vs.iavg[6] / ndp[nround]);
+				if (params.weighted) {
+					auto &share = shares[nround];
+					double total = 0;
+					for (double x : share)
+						total += x;
+					auto [lo, hi] = std::minmax_element(share.begin(), share.end());
+					printf("            receiver share == %.1f%% / %.1f%%\n", 100. * *lo / total, 100. * *hi / total);
+				}
+				printf("\n");
+				fflush(stdout);
+			}
+			stats.pop_front();
+			nround += 1;
+		}
+	}
+
+public:
+	Controller(const ProblemWrapper& wrapper, const MpiParameters &params, PRNG &prng) 
+		: abort(params), wrapper(wrapper), params(params), prng(prng), recv_rate(params.n_recv, 0), n_active_senders(params.n_send)
+	{
+		if (params.verbose)
+			banner();
+		mask = make_mask(wrapper.m);
+		start = wtime();
+		last_display = start;
+		new_version();
+		round_start[0] = start;
+		u64 msg[3] = {versions[0].first, versions[0].second, 0};
 		MPI_Bcast(msg, 3, MPI_UINT64_T, 0, params.world_comm);
-		
-		if (stop)
-			break;
-
-		int n_active_senders = params.n_send;
-		u64 ndp = 0;                      // #DP found for this i by all senders
-		double round_start = wtime();
-		double last_display = round_start;
-		while (n_active_senders > 0) {
+		if (params.n_groups > 1)
+			MPI_Irecv(peer_solution, 3, MPI_UINT64_T, MPI_ANY_SOURCE, TAG_SOLUTION, params.controllers_comm, &peer_request);
+	}
+
+	void banner() const
+	{
+	    printf("Starting MPI collision search with seed=%016" PRIx64 " (MPI engine)\n", prng.seed);
+		if (params.n_groups > 1)
+			printf("%d independent groups (only the first one is displayed)\n", params.n_groups);
+	    
+		char hbsize[8], hdsize[8], htdsize[8];
+		// senders: up to 1 + depth + backlog buffers / receiver.  Receivers: two pools, for the current and the next version
+		u64 S = params.n_send / params.n_nodes;
+		u64 R = params.n_recv / params.n_nodes;
+		u64 nbuf = 1 + params.buffer_depth + params.max_backlog;
+		u64 npool = 2 * params.recv_pool;
+		u64 bsize_node = 3 * sizeof(u64) * params.buffer_capacity * (nbuf * S * params.n_recv + npool * R);
+		if (params.aggregate) {
+			// two-level routing: senders only talk to the receivers of their node; relays have up to 1 + depth + backlog buffers / peer,
+			// and aggregators only talk to a gateway on each node they serve
+			u64 nbuf_relay = nbuf;
+			u64 n_gateways = (params.n_nodes + R - 1) / R;
+			bsize_node = 3 * sizeof(u64) * ((nbuf * S * R + (2 * npool + nbuf_relay * R) * R) * params.buffer_capacity
+			                                + (npool + nbuf_relay * n_gateways) * R * params.aggregate_capacity);
+		}
+		human_format(bsize_node, hbsize);
+		human_format(params.nbytes_memory, hdsize);
+		human_format(params.n_nodes * params.nbytes_memory, htdsize);
+		double log2_w = std::log2(params.w);
+		printf("RAM per node == %sB buffer + %sB dict.  Total dict size == %s (2^%.2f slots)\n", hbsize, hdsize, htdsize, log2_w);
+	    printf("Generating %.1f*w = %" PRId64 " = 2^%0.2f distinguished point / version\n", 
+	        	params.beta, params.points_per_version, std::log2(params.points_per_version));
+	}
+
+	/* (i, root_seed) of the first version */
+	pair<u64, u64> first_version() const
+	{
+		return versions[0];
+	}
+
+	bool done() const
+	{
+		return n_active_senders == 0 && nround == versions.size();
+	}
+
+	/* wait for something to happen, and deal with it */
+	void step()
+	{
+		if (n_active_senders == 0) {
+			/* the senders are gone: close the remaining versions */
+			for (; oldest < versions.size(); oldest++)
+				close_version(oldest);
+			for (auto &vs : stats)
+				vs.wait();
+		} else {
+			if (peer_request != MPI_REQUEST_NULL) {
+				/* we cannot block on two communicators at once */
+				for (;;) {
+					int flag;
+					MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, params.world_comm, &flag, MPI_STATUS_IGNORE);
+					if (flag)
+						break;
+					if (test_peers()) {
+						display();
+						return;
+					}
+				}
+			}
 			u64 buffer[10];
 			MPI_Status status;
 			MPI_Recv(buffer, 10, MPI_UINT64_T, MPI_ANY_SOURCE, MPI_ANY_TAG, params.world_comm, &status);
-			switch (status.MPI_TAG) {
-				case TAG_SENDER_CALLHOME: {
-					ndp += buffer[0];
-					int assignment = KEEP_GOING;
-					if (stop || ndp >= params.points_per_version) {
-						assignment = NEW_VERSION;
-						n_active_senders -= 1;
-					}
-					MPI_Send(&assignment, 1, MPI_INT, status.MPI_SOURCE, TAG_ASSIGNMENT, params.world_comm);
-
-					// verbosity
-					double now = wtime();
-					if (now - last_display > 0.5) {
-						last_display = now;
-						double delta = now - round_start;
-						double dp_rate = ndp / delta;
-						double nf_send_rate = dp_rate / params.theta;
-						char hsrate[8], hnrate[8];
-						human_format(nf_send_rate / params.n_send, hsrate);
-						u64 data_round = ndp * 3 * sizeof(u64) / params.n_nodes;
-						human_format(data_round / delta, hnrate);
-						double completion = (double) ndp / params.w / params.beta;
-						printf("\rRound %" PRId64 ":  %.1fs (%.1f%%, ETA: %.1fs).  %.2f*w #DP.  senders: %s #f/s.  Node-->%sB/s        ",
-							nround, delta, 100. * completion, delta / completion, (double) ndp / params.w, hsrate, hnrate);
-						fflush(stdout);
-					}
-					break;
-				}
+			handle(buffer, status);
+		}
+		display();
+	}
 
-				case TAG_SOLUTION:
-					solution = optional(tuple(buffer[0], buffer[1], buffer[2]));
-					stop = 1;
-			}
+	/* deal with what already happened, without blocking */
+	void poll()
+	{
+		for (;;) {
+			int flag;
+			MPI_Status status;
+			MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, params.world_comm, &flag, &status);
+			if (not flag)
+				break;
+			u64 buffer[10];
+			MPI_Recv(buffer, 10, MPI_UINT64_T, status.MPI_SOURCE, status.MPI_TAG, params.world_comm, &status);
+			handle(buffer, status);
+		}
+		test_peers();
+		display();
+	}
+
+	/* call home from the sender we are folded into, with its stats for the current version */
+	void local_callhome(const u64 report[2], u64 n_eval, double waiting_time, u64 assignment[3])
+	{
+		own_neval[report[1]] = n_eval;
+		own_wait[report[1]] = waiting_time;
+		assign(report, assignment);
+	}
+
+	/* shares of the receivers in version v (weighted partitioning) */
+	const vector<double> & shares_of(u64 v) const
+	{
+		return shares[v];
+	}
+
+	tuple<u64,u64,u64> finish()
+	{
+		abort.wait();
+		if (peer_request != MPI_REQUEST_NULL) {
+			MPI_Cancel(&peer_request);
+			MPI_Wait(&peer_request, MPI_STATUS_IGNORE);
 		}
+		if (params.verbose)
+			printf("Completed in %.2fs\n", wtime() - start);
+		assert(solution);
+		return *solution;
+	}
+};
 
-		// now is a good time to collect and display stats */
-
-		//             #f send, #f recv, collisions, probe_failures, robinhoods, non-colliding, bad_collisions
-		u64 iavg[7] = {0, 0, 0, 0, 0, 0, 0};
-		MPI_Reduce(MPI_IN_PLACE, iavg, 7, MPI_UINT64_T, MPI_SUM, 0, params.world_comm);
-		u64 ncoll = iavg[2];
-		ndp_total += ndp;
-		ncoll_total += ncoll;
-		u64 nf_send = iavg[0];
-		u64 nf_recv = iavg[1];
-		u64 nf_round = nf_send + nf_recv;
-		nf_total += nf_round;
-
-		//                # send wait  #recv wait
-		double dmin[2] = {HUGE_VAL,    HUGE_VAL};
-		double dmax[2] = {0, 0};
-		double davg[2] = {0, 0};
-		MPI_Reduce(MPI_IN_PLACE, dmin, 2, MPI_DOUBLE, MPI_MIN, 0, params.world_comm);
-		MPI_Reduce(MPI_IN_PLACE, dmax, 2, MPI_DOUBLE, MPI_MAX, 0, params.world_comm);
-		MPI_Reduce(MPI_IN_PLACE, davg, 2, MPI_DOUBLE, MPI_SUM, 0, params.world_comm);
-		davg[0] /= params.n_send;
-		davg[1] /= params.n_recv;
-
-		double delta = wtime() - round_start;
-
-		u64 N = 1ull << wrapper.n;
-		char hsrate[8], hrrate[8], hnrate[8];
-		human_format(nf_send / params.n_send / delta, hsrate);
-		human_format(nf_recv / params.n_recv / delta, hrrate);
-		u64 data_round = ndp * 3 * sizeof(u64) / params.n_nodes;
-		human_format(data_round / delta, hnrate);
-		
-		printf("\n");
-		printf("Round %" PRId64 " (%.2f*n/w).  %.1fs.  #DP (round / total) %.2f*w / %.2f*n.  #coll (round / total) %.2f*w / %.2f*n.  Total #f=2^%.3f.  node-->%sB/s \n",
-			nround, (double) nround * params.w / N, delta, (double) ndp / params.w, (double) ndp_total / N, (double) ncoll / params.w, (double) ncoll_total / N, std::log2(nf_total), hnrate);
-		printf("Senders.    Wait == %.2fs / %.2fs (%.1f%%) / %.2fs.  #f == 2^%.2f (%.0f%%).  f/s == %s\n",
-                dmin[0], davg[0], 100. * davg[0] / delta, dmax[0], std::log2(nf_send), 100. * nf_send / nf_round, hsrate);
-		printf("Receivers.  Wait == %.2fs / %.2fs (%.1f%%) / %.2fs.  #f == 2^%.2f (%.0f%%).  f/s == %s\n",
-                dmin[1], davg[1], 100. * davg[1] / delta, dmax[1], std::log2(nf_recv), 100. * nf_recv / nf_round, hrrate);
-		printf("            %.2f%% probe failure.  %.2f%% walk-robinhhod.  %.2f%% walk-noncolliding.  %.2f%% same-value\n",
-                100. * iavg[3] / ndp, 100. * iavg[4] / ndp, 100. * iavg[5] / ndp, 100. * iavg[6] / ndp);
-		printf("\n");
-		fflush(stdout);
-
-		nround += 1;
-	}
-	printf("Completed in %.2fs\n", wtime() - start);
-
-	assert(solution);
-	return *solution;
+/* run a dedicated controller process */
+template<typename ProblemWrapper>
+tuple<u64,u64,u64> controller(const ProblemWrapper& wrapper, const MpiParameters &params, PRNG &prng)
+{
+	Controller ctl(wrapper, params, prng);
+	while (not ctl.done())
+		ctl.step();
+	return ctl.finish();
 }
 
 }
-#endif
\ No newline at end of file
+#endif
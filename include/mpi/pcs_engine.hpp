@@ -42,7 +42,19 @@ static tuple<u64,u64,u64> run(ProblemWrapper& wrapper, MpiParameters &params, PR
 		receiver(wrapper, params);
 		break;
 	case SENDER:
-		sender(wrapper, params);
+		if (params.rank == 0) {
+			/* the controller is folded into this sender */
+			Controller ctl(wrapper, params, prng);
+			sender(wrapper, params, &ctl);
+			std::tie(i, x0, x1) = ctl.finish();
+		} else if (params.symmetric) {
+			/* this sender is also a receiver */
+			Receiver rcv(wrapper, params);
+			sender<ProblemWrapper>(wrapper, params, nullptr, &rcv);
+			rcv.finish();
+		} else {
+			sender(wrapper, params);
+		}
 	}
 
 	MPI_Bcast(&i, 1, MPI_UINT64_T, 0, params.world_comm);
@@ -2,71 +2,406 @@
 #define MITM_MPI_RECEIVER
 
 #include <vector>
+#include <memory>
 #include <mpi.h>
 
 #include "engine_common.hpp"
 #include "mpi/common.hpp"
+#include "mpi/pcs_relay.hpp"
+#include "mpi/shm_rings.hpp"
+#include "mpi/rma_rings.hpp"
 
 namespace mitm {
 
+/* process a buffer of (seed, end, len | target << 32) triples.  Report the golden collision to the controller */
 template<class ProblemWrapper>
-void receiver(ProblemWrapper& wrapper, const MpiParameters &params)
+static void process_buffer(ProblemWrapper& wrapper, Counters &ctr, const MpiParameters &params, PcsDict &dict,
+                           u64 i, u64 root_seed, const u64 *buffer, size_t size)
 {
-	int jbits = std::log2(10 * params.w) + 8;
-    PcsDict dict(jbits, params.w / params.n_recv);
+	for (size_t k = 0; k < size; k += 3) {
+		u64 seed = buffer[k];
+		u64 end = buffer[k + 1];
+		u64 len = buffer[k + 2] & 0xffffffff;
+		auto solution = process_distinguished_point(wrapper, ctr, params, dict, i, root_seed, seed, end, len);
+		if (solution) {          // call home !
+			// maybe save it to a file, just in case
+			auto [i, x0, x1] = *solution;
+			u64 golden[3] = {i, x0, x1};
+			MPI_Send(golden, 3, MPI_UINT64_T, 0, TAG_SOLUTION, params.world_comm);
+		}
+	}
+}
+
+/*
+ * A receiver owns (a slice of) the dictionary.  It is either a dedicated process, or it is folded
+ * into a sender (symmetric mode): then this sender polls it in its main loop, and hands it the
+ * DPs that it keeps for itself directly.
+ */
+template<class ProblemWrapper>
+class Receiver {
+public:
+	using Buffer = RecvBuffers::Buffer;
+	AbortSignal abort;              // once raised, incoming DPs are just discarded
 
-    assert(params.w == dict.n_slots * params.n_recv);
+private:
+	ProblemWrapper wrapper;         // (our own copy: its n_eval only counts our work)
+	const MpiParameters &params;
 
-	for (;;) {
-		/* get data from controller */
-		u64 msg[3];   // i, root_seed, stop?
-		MPI_Bcast(msg, 3, MPI_UINT64_T, 0, params.world_comm);
-		if (msg[2] != 0)
-			return;      // controller tells us to stop	
+	/* 
+	 * The dict is cleared by its owner right away: first touch puts its pages on our NUMA zone.
+	 * A shared dict is made of the slices of all the receivers of the node, each clears its own.
+	 */
+	MPI_Win win = MPI_WIN_NULL;
+	u64 lo, hi;                     // our slice of a shared dict
+	std::unique_ptr<PcsDict> dict;
 
-		RecvBuffers recvbuf(params.inter_comm, TAG_POINTS, 3 * params.buffer_capacity);
-		u64 i = msg[0];
-		u64 root_seed = msg[1];
-		wrapper.n_eval = 0;
-		Counters ctr;
-	    ctr.ready(wrapper.n, params.w);
+	/*
+	 * Senders start the next version as soon as the controller tells them, while we
+	 * are still busy with the current one.  What arrives early is kept aside.
+	 */
+	u64 msg[3];                     // i, root_seed, stop?
+	MPI_Comm comm;
+	RecvBuffers recvbuf_a, recvbuf_b;
+	RecvBuffers *current = &recvbuf_a;
+	RecvBuffers *next = &recvbuf_b;
+	Buffer backlog;                 // DPs of the next version
+	std::deque<VersionStats> stats;
 
-		// receive and process data from senders
-		for (;;) {
-			if (recvbuf.complete())
-				break;                      // all senders are done
-			auto ready = recvbuf.wait();
-			// process incoming buffers of distinguished points
-			for (auto it = ready.begin(); it != ready.end(); it++) {
-				auto & buffer = **it;
-				for (size_t k = 0; k < buffer.size(); k += 3) {
-					u64 seed = buffer[k];
-					u64 end = buffer[k + 1];
-					u64 len = buffer[k + 2];
-					auto solution = process_distinguished_point(wrapper, ctr, params, dict, i, root_seed, seed, end, len);
-					if (solution) {          // call home !
-						// maybe save it to a file, just in case
-						auto [i, x0, x1] = *solution;
-						u64 golden[3] = {i, x0, x1};
-						MPI_Send(golden, 3, MPI_UINT64_T, 0, TAG_SOLUTION, params.world_comm);
-					}
-				}
+	/* two-level routing: we also forward DPs for the others, so we must never block in MPI */
+	std::unique_ptr<Relay> aggregator, gateway;
+
+	/* 
+	 * Shared-memory or RMA rings: the senders may be waiting for room, so we must never block in
+	 * MPI either.  With RMA, all the senders write in our rings.
+	 */
+	std::unique_ptr<ReceiverRings> rings;
+	bool polling;
+
+	u64 version = 0;
+	u64 i, root_seed;
+	optional<Counters> ctr;
+	u64 n_processed;                // #DP in this version
+	double version_start;
+	double busy;                    // time spent on this version, minus waiting
+	MPI_Request announcement = MPI_REQUEST_NULL;    // of the next version, once we are done with this one
+	bool stopped = false;
+	vector<u64> send_neval;         // (symmetric mode) stats of the sender we are folded into
+	vector<double> send_wait;
+
+	PcsDict * make_dict()
+	{
+		int jbits = std::log2(10 * params.w) + 8;
+		u64 share = params.w / params.n_recv;
+		u64 *memory = nullptr;
+		int node_rank = 0;
+		if (params.shared_dict) {
+			MPI_Comm_rank(params.recv_node_comm, &node_rank);
+			u64 *mine;
+			MPI_Win_allocate_shared(share * sizeof(u64), sizeof(u64), MPI_INFO_NULL, params.recv_node_comm, &mine, &win);
+			MPI_Aint size;
+			int disp_unit;
+			MPI_Win_shared_query(win, 0, &size, &disp_unit, &memory);
+			MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+		}
+		auto d = new PcsDict(jbits, params.w / params.n_dict, memory);
+		assert(params.w == d->n_slots * params.n_dict);
+		lo = node_rank * share;
+		hi = lo + share;
+		if (params.shared_dict) {
+			d->flush(lo, hi);
+			MPI_Win_sync(win);
+			MPI_Barrier(params.recv_node_comm);
+			MPI_Win_sync(win);
+		}
+		return d;
+	}
+
+	static MPI_Comm incoming(const MpiParameters &params)
+	{
+		if (params.symmetric)
+			return params.work_comm;
+		return params.aggregate ? params.recv_node_comm : params.inter_comm;
+	}
+
+	/* #processes that send to us (-1: all of them) */
+	static int n_sources(const MpiParameters &params)
+	{
+		return params.aggregate ? active_gateways(params) : -1;
+	}
+
+	void process(const u64 *data, size_t size)
+	{
+		if (not abort.test())
+			process_buffer(wrapper, *ctr, params, *dict, i, root_seed, data, size);
+		n_processed += size / 3;
+	}
+
+	/* what must go on even while we wait.  Return true if something was done */
+	bool background()
+	{
+		bool busy = false;
+		if (params.aggregate) {
+			busy |= aggregator->progress();
+			busy |= gateway->progress();
+		}
+		if (rings) {
+			auto process = [&](const u64 *data, size_t size) { this->process(data, size); };
+			busy |= (rings->consume(version, process, backlog) > 0);
+		}
+		return busy;
+	}
+
+	/* MPI_Wait, but keep the background going */
+	void wait_for(MPI_Request &req)
+	{
+		if (polling) {
+			int flag = 0;
+			while (not flag) {
+				background();
+				MPI_Test(&req, &flag, MPI_STATUS_IGNORE);
 			}
+		} else {
+			MPI_Wait(&req, MPI_STATUS_IGNORE);
 		}
+	}
+
+	/* shared dict: wait until all the receivers of the node are there */
+	void sync_node()
+	{
+		MPI_Request req;
+		MPI_Win_sync(win);
+		MPI_Ibarrier(params.recv_node_comm, &req);
+		wait_for(req);
+		MPI_Win_sync(win);
+	}
+
+	/* are all the streams of the current version over? */
+	bool complete()
+	{
+		return current->complete() && (not rings || rings->complete());
+	}
+
+	/* same as current->wait(), but keep the background going */
+	const vector<Buffer *> & poll_ready()
+	{
+		for (;;) {
+			double start = wtime();
+			bool busy = background();
+			auto &ready = current->test();
+			if (not ready.empty() || complete())
+				return ready;
+			if (not busy)
+				current->waiting_time += wtime() - start;
+		}
+	}
+
+	/* process incoming buffers of distinguished points, and make room for the next version */
+	void process_ready(const vector<Buffer *> &ready)
+	{
+		for (auto it = ready.begin(); it != ready.end(); it++)
+			process((*it)->data(), (*it)->size());
+		auto &ahead = next->test();
+		for (auto it = ahead.begin(); it != ahead.end(); it++)
+			backlog.insert(backlog.end(), (*it)->begin(), (*it)->end());
+	}
+
+	void start_version()
+	{
+		i = msg[0];
+		root_seed = msg[1];
+		wrapper.n_eval = 0;
+		n_processed = 0;
+		version_start = wtime();
+		ctr.emplace();
+	    ctr->ready(wrapper.n, params.w);
 
+		Buffer early;
+		std::swap(early, backlog);
+		process(early.data(), early.size());
+	}
+
+	/* all the DPs of this version are there */
+	void end_version()
+	{
 		// now is a good time to collect stats
-		//             #f send  #f recv
-		u64 iavg[7] = {0,       wrapper.n_eval, ctr.n_collisions, ctr.bad_probe, ctr.bad_walk_robinhood, ctr.bad_walk_noncolliding, ctr.bad_collision};
-		MPI_Reduce(iavg, NULL, 7, MPI_UINT64_T, MPI_SUM, 0, params.world_comm);
-		//                send wait recv wait
-		double dmin[2] = {HUGE_VAL, recvbuf.waiting_time};
-		double dmax[2] = {0,        recvbuf.waiting_time};
-		double davg[2] = {0,        recvbuf.waiting_time};
-		MPI_Reduce(dmin, NULL, 2, MPI_DOUBLE, MPI_MIN, 0, params.world_comm);
-		MPI_Reduce(dmax, NULL, 2, MPI_DOUBLE, MPI_MAX, 0, params.world_comm);
-		MPI_Reduce(davg, NULL, 2, MPI_DOUBLE, MPI_SUM, 0, params.world_comm);
-		dict.flush();
+		cleanup_stats(stats);
+		auto &vs = stats.emplace_back();
+		//          #f recv
+		vs.iavg[1] = wrapper.n_eval;
+		vs.iavg[2] = ctr->n_collisions;
+		vs.iavg[3] = ctr->bad_probe;
+		vs.iavg[4] = ctr->bad_walk_robinhood;
+		vs.iavg[5] = ctr->bad_walk_noncolliding;
+		vs.iavg[6] = ctr->bad_collision;
+		//          recv wait
+		vs.dmin[1] = current->waiting_time;
+		vs.dmax[1] = current->waiting_time;
+		vs.davg[1] = current->waiting_time;
+		if (params.symmetric) {
+			/* the sender we are folded into is done with this version (it sent us its end-of-stream marker) */
+			vs.iavg[0] = send_neval[version];
+			vs.dmin[0] = send_wait[version];
+			vs.dmax[0] = send_wait[version];
+			vs.davg[0] = send_wait[version];
+		}
+		vs.reduce(params);
+		busy = wtime() - version_start - current->waiting_time;
+		current->waiting_time = 0;
+		if (params.shared_dict) {
+			/* the others may still be using the dict for this version */
+			sync_node();
+			dict->flush(lo, hi);
+			sync_node();
+		} else {
+			dict->flush();
+		}
+
+		/* what comes next? */
+		MPI_Irecv(msg, 3, MPI_UINT64_T, 0, TAG_VERSION, params.world_comm, &announcement);
+	}
+
+	/* the controller told us what comes next */
+	void next_version()
+	{
+		if (msg[2] != 0) {
+			next->cancel();       // controller tells us to stop
+			if (params.aggregate) {
+				/* other receivers may still need us to forward their last DPs */
+				while (not aggregator->finished(version) || not gateway->finished(version))
+					background();
+				aggregator->stop();
+				gateway->stop();
+			}
+			stopped = true;
+			return;
+		}
+		if (params.weighted) {
+			/* how fast can we go?  The controller splits the next versions accordingly */
+			u64 report[2] = {(u64) params.local_rank, (u64) (n_processed / std::max(busy, 1e-3))};
+			MPI_Send(report, 2, MPI_UINT64_T, 0, TAG_RECEIVER_CALLHOME, params.world_comm);
+		}
+		std::swap(current, next);
+		next->listen(version_tag(version + 2));
+		if (rings)
+			rings->next_version();
+		version += 1;
+		start_version();
 	}
+
+public:
+	Receiver(const ProblemWrapper &wrapper, const MpiParameters &params) 
+		: abort(params), wrapper(wrapper), params(params), dict(make_dict()), comm(incoming(params)),
+		  recvbuf_a(comm, version_tag(0), 3 * params.buffer_capacity, params.recv_pool, n_sources(params)),
+		  recvbuf_b(comm, version_tag(1), 3 * params.buffer_capacity, params.recv_pool, n_sources(params))
+	{
+		/* get the first version from the controller.  The next ones are announced by TAG_VERSION messages */
+		MPI_Bcast(msg, 3, MPI_UINT64_T, 0, params.world_comm);
+
+		if (params.aggregate) {
+			aggregator = std::make_unique<Relay>(params.node_inter_comm, params.buffer_capacity, 
+			                     params.local_comm, params.aggregate_capacity, aggregator_hop(params), params);
+			gateway = std::make_unique<Relay>(params.local_comm, params.aggregate_capacity, 
+			                     params.recv_node_comm, params.buffer_capacity, gateway_hop(params), params);
+		}
+		if (params.shm_rings)
+			rings = std::make_unique<ReceiverRings>(params);
+		if (params.rma)
+			rings = std::make_unique<ReceiverRings>(params, params.work_comm, false);
+		polling = params.aggregate || rings;
+		start_version();
+	}
+
+	/* (i, root_seed) of the first version */
+	pair<u64, u64> first_version() const
+	{
+		return pair(msg[0], msg[1]);
+	}
+
+	/* the version we are working on */
+	u64 current_version() const
+	{
+		return version;
+	}
+
+	bool done() const
+	{
+		return stopped;
+	}
+
+	/* wait for something to happen, and deal with it */
+	void step()
+	{
+		if (announcement != MPI_REQUEST_NULL) {
+			wait_for(announcement);
+			next_version();
+		} else if (complete()) {
+			end_version();
+		} else {
+			process_ready(polling ? poll_ready() : current->wait());
+		}
+	}
+
+	/* deal with what already happened, without blocking */
+	void poll()
+	{
+		if (stopped)
+			return;
+		background();
+		if (announcement != MPI_REQUEST_NULL) {
+			int flag;
+			MPI_Test(&announcement, &flag, MPI_STATUS_IGNORE);
+			if (flag)
+				next_version();
+		} else {
+			process_ready(current->test());
+			if (complete())
+				end_version();
+		}
+	}
+
+	/* (symmetric mode) a DP of version v that our own sender keeps for us */
+	void local(u64 seed, u64 end, u64 packed, u64 v)
+	{
+		if (v == version) {
+			u64 dp[3] = {seed, end, packed};
+			process(dp, 3);
+		} else {
+			assert(v == version + 1);
+			backlog.push_back(seed);
+			backlog.push_back(end);
+			backlog.push_back(packed);
+		}
+	}
+
+	/* (symmetric mode) our own sender is done with version v */
+	void sender_stats(u64 v, u64 n_eval, double waiting_time)
+	{
+		send_neval.resize(v + 1);
+		send_wait.resize(v + 1);
+		send_neval[v] = n_eval;
+		send_wait[v] = waiting_time;
+	}
+
+	void finish()
+	{
+		if (params.shared_dict) {
+			MPI_Win_unlock_all(win);
+			MPI_Win_free(&win);
+		}
+		for (auto &vs : stats)
+			vs.wait();
+		abort.wait();
+	}
+};
+
+/* run a dedicated receiver process */
+template<class ProblemWrapper>
+void receiver(ProblemWrapper& wrapper, const MpiParameters &params)
+{
+	Receiver rcv(wrapper, params);
+	while (not rcv.done())
+		rcv.step();
+	rcv.finish();
 }
 
 }
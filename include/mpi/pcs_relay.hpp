@@ -0,0 +1,177 @@
+#ifndef MITM_MPI_RELAY
+#define MITM_MPI_RELAY
+
+#include <vector>
+#include <mpi.h>
+
+#include "mpi/common.hpp"
+
+namespace mitm {
+
+/*
+ * Two-level routing of the DPs.  Senders hand their DPs to an aggregator on their node,
+ * depending on the node of the target receiver.  Each aggregator sends everything that
+ * goes to a given node to a single gateway there, so that one stream crosses the network
+ * for each pair of nodes.  The gateway then dispatches the DPs to the receivers of its node.
+ *
+ * Aggregators and gateways are receiver processes: each receiver is the aggregator for
+ * the nodes X such that X % #local receivers == its rank on the node, and the gateway for
+ * the nodes A such that A % #local receivers == its rank on the node.  An aggregator only 
+ * talks to the gateways it feeds (one per node it serves), and a gateway only hears from the 
+ * aggregators that feed it (one per node it serves): with R receivers per node, a version
+ * ends with n_nodes / R markers from each relay, and not n_recv.
+ */
+
+/* where a relay sends DPs: peers (ranks in the outgoing communicator) and target receiver --> peer */
+struct Hop {
+	vector<int> peers;
+	vector<int> route;
+	int n_sources = -1;                // #incoming streams (-1: everybody on the other side)
+};
+
+/* sender --> aggregator, inside the node (params.node_inter_comm) */
+static vector<int> sender_route(const MpiParameters &params)
+{
+	int n_agg = n_peers(params.node_inter_comm);
+	vector<int> route(params.n_recv);
+	for (int t = 0; t < params.n_recv; t++)
+		route[t] = params.recv_node[t] % n_agg;
+	return route;
+}
+
+/* aggregator --> gateway on the node of the target (params.local_comm), for the nodes we serve */
+static Hop aggregator_hop(const MpiParameters &params)
+{
+	int me;
+	MPI_Comm_rank(params.recv_node_comm, &me);
+	int n_agg = params.receivers_of_node(params.node_id).size();
+	Hop hop;
+	hop.route.resize(params.n_recv, -1);
+	for (int node = me; node < params.n_nodes; node += n_agg) {
+		auto gateways = params.receivers_of_node(node);
+		hop.peers.push_back(gateways[params.node_id % gateways.size()]);
+		for (int t : gateways)
+			hop.route[t] = hop.peers.size() - 1;
+	}
+	return hop;
+}
+
+/* gateway --> target, inside the node (params.recv_node_comm).  From the nodes we serve */
+static Hop gateway_hop(const MpiParameters &params)
+{
+	int me;
+	MPI_Comm_rank(params.recv_node_comm, &me);
+	auto local = params.receivers_of_node(params.node_id);
+	Hop hop;
+	hop.route.resize(params.n_recv, -1);
+	for (size_t k = 0; k < local.size(); k++) {
+		hop.peers.push_back(k);
+		hop.route[local[k]] = k;
+	}
+	hop.n_sources = 0;
+	for (int node = me; node < params.n_nodes; node += local.size())
+		hop.n_sources += 1;
+	return hop;
+}
+
+/* #gateways of this node that serve some node (the others stay idle) */
+static int active_gateways(const MpiParameters &params)
+{
+	return std::min<int>(params.receivers_of_node(params.node_id).size(), params.n_nodes);
+}
+
+/*
+ * Forwards the streams of DPs (seed, end, len | target << 32) coming from a set of processes
+ * to another set, version after version.  Like the receivers, this accepts the next version
+ * before the current one is over.  Never blocks: when the outgoing backlog of some peer is
+ * over params.max_backlog buffers, incoming buffers are left unmatched until it drains, so 
+ * that the upstream processes run out of credits (as with any receiver).
+ */
+class Relay {
+public:
+	using Buffer = RecvBuffers::Buffer;
+	u64 n_forwarded = 0;
+
+private:
+	RecvBuffers in_a, in_b;
+	RecvBuffers *current = &in_a;
+	RecvBuffers *next = &in_b;
+	SendBuffers out;
+	const vector<int> route;           // target receiver --> peer
+	const bool idle;                   // no sources: nothing to forward, not even markers
+	Buffer backlog;                    // DPs of the next version
+	u64 version = 0;
+
+	void forward(const Buffer &buffer)
+	{
+		for (size_t k = 0; k < buffer.size(); k += 3) {
+			int target = buffer[k + 2] >> 32;
+			assert(route[target] >= 0);
+			out.push3(buffer[k], buffer[k + 1], buffer[k + 2], route[target]);
+		}
+		n_forwarded += buffer.size() / 3;
+	}
+
+public:
+	Relay(MPI_Comm from, size_t in_capacity, MPI_Comm to, size_t out_capacity, const Hop &hop, const MpiParameters &params)
+		: in_a(from, version_tag(0), 3 * in_capacity, params.recv_pool, hop.n_sources),
+		  in_b(from, version_tag(1), 3 * in_capacity, params.recv_pool, hop.n_sources),
+		  out(to, version_tag(0), 3 * out_capacity, params.buffer_depth, params.max_backlog, hop.peers), route(hop.route),
+		  idle(hop.n_sources == 0)
+	{
+		out.elastic = true;            // pushing never waits: congested() stops the intake instead
+	}
+
+	/* forward whatever has arrived.  Return true if something was done */
+	bool progress()
+	{
+		bool busy = false;
+		if (idle)
+			return false;
+		out.progress();
+		if (out.congested())
+			return false;
+		auto &ready = current->test();
+		for (auto it = ready.begin(); it != ready.end(); it++) {
+			forward(**it);
+			busy = true;
+		}
+		auto &ahead = next->test();
+		for (auto it = ahead.begin(); it != ahead.end(); it++) {
+			backlog.insert(backlog.end(), (*it)->begin(), (*it)->end());
+			busy = true;
+		}
+		if (current->complete()) {
+			/* all our sources are done with this version: so are we */
+			out.next_stream(version_tag(version + 1));
+			version += 1;
+			std::swap(current, next);
+			next->listen(version_tag(version + 1));
+			Buffer early;
+			std::swap(early, backlog);
+			forward(early);
+			busy = true;
+		}
+		out.progress();
+		return busy;
+	}
+
+	/* true once all the versions up to `last` have been forwarded */
+	bool finished(u64 last) const
+	{
+		return idle || version > last;
+	}
+
+	/* the last version is over: nothing else will come */
+	void stop()
+	{
+		if (idle)
+			return;
+		current->cancel();
+		next->cancel();
+		out.drain();
+	}
+};
+
+}
+#endif
@@ -2,12 +2,18 @@
 #define MITM_MPI_SENDER
 #include <err.h>
 #include <vector>
+#include <memory>
 
 #include <mpi.h>
 
 #include "common.hpp"
 #include "engine_common.hpp"
 #include "mpi/common.hpp"
+#include "mpi/pcs_relay.hpp"
+#include "mpi/pcs_controller.hpp"
+#include "mpi/pcs_receiver.hpp"
+#include "mpi/shm_rings.hpp"
+#include "mpi/rma_rings.hpp"
 
 namespace mitm {
 
@@ -27,86 +33,243 @@ static void start_chain(const Parameters &params, u64 out_mask, u64 root_seed, u
 }
 
 
+/* 
+ * Close the stream of the current version (without waiting for the receivers), 
+ * then report stats about it to the controller in the background (unless we host the
+ * controller or a receiver: then they already have them).
+ */
+static void end_version(SendBuffers &sendbuf, std::deque<VersionStats> &stats, u64 &n_eval, 
+                        u64 version, bool last, const MpiParameters &params, bool folded)
+{
+	if (last && not folded)
+		sendbuf.flush();
+	else if (last)
+		sendbuf.next_stream(version_tag(version));   // the caller keeps the controller / receiver going until it is gone
+	else
+		sendbuf.next_stream(version_tag(version + 1));
+
+	if (folded) {
+		n_eval = 0;
+		sendbuf.waiting_time = 0;
+		return;
+	}
+	cleanup_stats(stats);
+	auto &vs = stats.emplace_back();
+	vs.iavg[0] = n_eval;                 // #f send
+	vs.dmin[0] = sendbuf.waiting_time;   // send wait
+	vs.dmax[0] = sendbuf.waiting_time;
+	vs.davg[0] = sendbuf.waiting_time;
+	vs.reduce(params);
+	n_eval = 0;
+	sendbuf.waiting_time = 0;
+}
+
+
+/* 
+ * When `controller` is given, we host the controller and poll it in the main loop.  When `receiver` 
+ * is given (symmetric mode), we host a receiver: we poll it as well, and keep our own DPs for it.
+ */
 template<class ProblemWrapper>
-void sender(ProblemWrapper& wrapper, const MpiParameters &params)
+void sender(ProblemWrapper& wrapper, const MpiParameters &params, Controller<ProblemWrapper> *controller = nullptr,
+            Receiver<ProblemWrapper> *receiver = nullptr)
 {
     int jbits = std::log2(10 * params.w) + 8;
     u64 jmask = make_mask(jbits);
-	for (;;) {
-		/* get data from controller */
-		u64 msg[3];   // i, root_seed, stop?
+
+	/* get the first version from the controller.  The next ones come with NEW_VERSION */
+	u64 msg[3];   // i, root_seed, stop?
+	if (controller)
+		std::tie(msg[0], msg[1]) = controller->first_version();
+	else if (receiver)
+		std::tie(msg[0], msg[1]) = receiver->first_version();
+	else
 		MPI_Bcast(msg, 3, MPI_UINT64_T, 0, params.world_comm);
-		if (msg[2] != 0)
-			return;      // controller tells us to stop
-
-    	u64 n_dp = 0;    // #DP found since last report
-    	wrapper.n_eval = 0;
-		SendBuffers sendbuf(params.inter_comm, TAG_POINTS, 3 * params.buffer_capacity);
-    	double last_ping = wtime();
-		u64 i = msg[0];
-		u64 root_seed = msg[1];
-
-		/* current state of the chains */
-		constexpr int vlen = ProblemWrapper::vlen;
-    	u64 x[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
-    	u64 y[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
-    	u64 len[vlen], seed[vlen];
-		u64 j = params.local_rank;
-
-		/* infinite loop to generate DPs */
-        for (int k = 0; k < vlen; k++)
-            start_chain(params, wrapper.out_mask, root_seed, j, x, len, seed, params.n_send, k);
-		assert((j & jmask) == j);
-
-		for (;;) {
-			/* call home? */
-            if ((n_dp % 10000 == 9999) && (wtime() - last_ping >= params.ping_delay)) {
-				last_ping = wtime();
-            	MPI_Send(&n_dp, 1, MPI_UINT64_T, 0, TAG_SENDER_CALLHOME, params.world_comm);
-				n_dp = 0;
-
-            	int assignment;
-            	MPI_Recv(&assignment, 1, MPI_INT, 0, TAG_ASSIGNMENT, params.world_comm, MPI_STATUS_IGNORE);
-            	if (assignment == NEW_VERSION) {        /* new broadcast */
-            	   	sendbuf.flush();   
-            		break;
-            	}
-            }
-
-			/* advance all the chains */
-        	wrapper.vmixf(i, x, y);
-
-			/* test for distinguished points */ 
-			for (int k = 0; k < vlen; k++) {
-			    len[k] += 1;
-			    x[k] = y[k];
-			    bool dp = is_distinguished_point(x[k], params.threshold);
-			    bool failure = (len[k] == params.dp_max_it);
-			    if (dp) {
-					n_dp += 1;
-					int target_recv = (int) (x[k] % params.n_recv);
-					sendbuf.push3(seed[k], x[k] / params.n_recv, len[k], target_recv);			        
-			    }
-			    if (dp || failure) {
-			        start_chain(params, wrapper.out_mask, root_seed, j, x, len, seed, params.n_send, k);
-			        assert((j & jmask) == j);
-			    }
+	u64 version = 0;
+	u64 i = msg[0];
+	u64 root_seed = msg[1];
+	bool folded = (controller != nullptr);
+
+	u64 n_dp = 0;    // #DP found since last report
+	wrapper.n_eval = 0;
+	/* DPs go straight to their receiver, or to an aggregator on this node (two-level routing) */
+	MPI_Comm comm = params.aggregate ? params.node_inter_comm : params.inter_comm;
+	if (receiver)
+		comm = params.work_comm;
+	vector<int> route(params.n_recv);
+	for (int t = 0; t < params.n_recv; t++)
+		route[t] = t;
+	if (params.aggregate)
+		route = sender_route(params);
+	SendBuffers sendbuf(comm, version_tag(version), 3 * params.buffer_capacity, params.buffer_depth, params.max_backlog);
+
+	/* with weighted partitioning, each receiver owns a range of DPs, that changes with each version */
+	Partition partition(params);
+
+	/* with shared dictionaries, any receiver of the right node will do: they take turns */
+	vector<vector<int>> node_receivers(params.n_nodes);
+	vector<u64> turn(params.n_nodes, 0);
+	if (params.shared_dict)
+		for (int node = 0; node < params.n_nodes; node++)
+			node_receivers[node] = params.receivers_of_node(node);
+	/*
+	 * If we host the controller, we must not block in MPI: the receivers may be waiting for
+	 * the other senders, who may be waiting for the controller.  Same thing if we host a 
+	 * receiver: the other senders may be waiting for it.
+	 */
+	bool quiet = folded || receiver;     // somebody else reports our stats
+	sendbuf.elastic = quiet;
+	std::deque<VersionStats> stats;
+	double last_ping = wtime();
+	optional<AbortSignal> own_abort;
+	if (not folded && not receiver)
+		own_abort.emplace(params);
+	AbortSignal &abort = folded ? controller->abort : receiver ? receiver->abort : *own_abort;
+	u64 n_iter = 0;
+
+	/* DPs for the receivers of our node go through shared memory, or all of them through RMA.  End-of-stream markers still go through MPI */
+	std::unique_ptr<SenderRings> rings;
+	if (params.shm_rings)
+		rings = std::make_unique<SenderRings>(params);
+	std::unique_ptr<RmaSenderRings> rma;
+	if (params.rma)
+		rma = std::make_unique<RmaSenderRings>(params);
+	auto idle = [&]() {
+		if (folded)
+			controller->poll();
+		if (receiver)
+			receiver->poll();
+		sendbuf.progress();
+	};
+	auto close_version = [&](bool last) {
+		if (rings)
+			rings->end_version(idle);
+		if (rma)
+			rma->end_version(idle);
+		if (receiver)
+			receiver->sender_stats(version, wrapper.n_eval, sendbuf.waiting_time);
+		end_version(sendbuf, stats, wrapper.n_eval, version, last, params, quiet);
+	};
+
+	/* current state of the chains */
+	constexpr int vlen = ProblemWrapper::vlen;
+	u64 x[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+	u64 y[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+	u64 len[vlen], seed[vlen];
+	u64 j = params.local_rank;
+
+	for (int k = 0; k < vlen; k++)
+		start_chain(params, wrapper.out_mask, root_seed, j, x, len, seed, params.n_send, k);
+	assert((j & jmask) == j);
+
+	/* infinite loop to generate DPs */
+	for (;;) {
+		/* call home?  Right away if the golden collision has been found */
+		n_iter += 1;
+		bool aborted = false;
+		if ((n_iter & 1023) == 0) {
+			if (quiet) {
+				do
+					idle();
+				while (sendbuf.congested());
+			}
+			aborted = abort.test();
+		}
+		if (params.progress_every > 0 && n_iter % params.progress_every == 0)
+			sendbuf.poke();
+		if (aborted || ((n_dp % 10000 == 9999) && (wtime() - last_ping >= params.ping_delay))) {
+			last_ping = wtime();
+			u64 report[2] = {n_dp, version};
+			u64 assignment[3];   // KEEP_GOING, NEW_VERSION (+ i, root_seed) or STOP (+ last version)
+			if (folded) {
+				controller->local_callhome(report, wrapper.n_eval, sendbuf.waiting_time, assignment);
+			} else {
+				MPI_Send(report, 2, MPI_UINT64_T, 0, TAG_SENDER_CALLHOME, params.world_comm);
+				MPI_Recv(assignment, 3, MPI_UINT64_T, 0, TAG_ASSIGNMENT, params.world_comm, MPI_STATUS_IGNORE);
 			}
+			n_dp = 0;
+			if (assignment[0] == STOP) {
+				/* the receivers expect a (maybe empty) stream for each version announced so far */
+				u64 last_version = assignment[1];
+				for (; version < last_version; version++)
+					close_version(false);
+				close_version(true);
+				break;
+			}
+			if (assignment[0] == NEW_VERSION) {
+				/* start the chains of the next version while the receivers finish this one */
+				close_version(false);
+				version += 1;
+				/* our receiver only keeps DPs of its current version and the next one */
+				if (receiver)
+					while (receiver->current_version() + 1 < version)
+						idle();
+				i = assignment[1];
+				root_seed = assignment[2];
+				if (params.weighted) {
+					vector<double> share(params.n_recv);
+					if (folded)
+						share = controller->shares_of(version);
+					else
+						MPI_Recv(share.data(), params.n_recv, MPI_DOUBLE, 0, TAG_PARTITION, params.world_comm, MPI_STATUS_IGNORE);
+					partition.balance(share);
+				}
+				j = params.local_rank;
+				for (int k = 0; k < vlen; k++)
+					start_chain(params, wrapper.out_mask, root_seed, j, x, len, seed, params.n_send, k);
+			}
+		}
+
+		/* advance all the chains */
+		wrapper.vmixf(i, x, y);
+
+		/* test for distinguished points */ 
+		for (int k = 0; k < vlen; k++) {
+		    len[k] += 1;
+		    x[k] = y[k];
+		    bool dp = is_distinguished_point(x[k], params.threshold);
+		    bool failure = (len[k] == params.dp_max_it);
+		    if (dp) {
+				n_dp += 1;
+				u64 d = x[k] % params.n_dict;        // which dictionary?
+				u64 target_recv = params.weighted ? partition(x[k]) : d;
+				if (params.shared_dict) {
+					auto &local = node_receivers[d];
+					target_recv = local[turn[d]++ % local.size()];
+				}
+				u64 end = x[k] / params.end_divisor;
+				u64 packed = len[k] | (target_recv << 32);
+				if (receiver && (int) target_recv == params.local_rank)
+					receiver->local(seed[k], end, packed, version);
+				else if (rma)
+					rma->push3(seed[k], end, packed, target_recv, idle);
+				else if (rings && rings->is_local(target_recv))
+					rings->push3(seed[k], end, packed, target_recv, idle);
+				else
+					sendbuf.push3(seed[k], end, packed, route[target_recv]);
+		    }
+		    if (dp || failure) {
+		        start_chain(params, wrapper.out_mask, root_seed, j, x, len, seed, params.n_send, k);
+		        assert((j & jmask) == j);
+		    }
 		}
+	}
 
-		// now is a good time to collect stats
-		//             #f send,   
-		u64 iavg[7] = {wrapper.n_eval, 0, 0, 0, 0, 0, 0};
-		MPI_Reduce(iavg, NULL, 7, MPI_UINT64_T, MPI_SUM, 0, params.world_comm);
-		//                send wait             recv wait
-		double dmin[2] = {sendbuf.waiting_time, HUGE_VAL};
-		double dmax[2] = {sendbuf.waiting_time, 0};
-		double davg[2] = {sendbuf.waiting_time, 0};
-		MPI_Reduce(dmin, NULL, 2, MPI_DOUBLE, MPI_MIN, 0, params.world_comm);
-		MPI_Reduce(dmax, NULL, 2, MPI_DOUBLE, MPI_MAX, 0, params.world_comm);
-		MPI_Reduce(davg, NULL, 2, MPI_DOUBLE, MPI_SUM, 0, params.world_comm);
+	for (auto &vs : stats)
+		vs.wait();
+	if (folded) {
+		/* the others may still need the controller */
+		while (not sendbuf.test())
+			controller->poll();
+		while (not controller->done())
+			controller->step();
+	} else if (receiver) {
+		/* the others may still need our receiver */
+		while (not sendbuf.test() || not receiver->done())
+			receiver->poll();
+	} else {
+		abort.wait();
 	}
 }
 
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,89 @@
+#ifndef MITM_MPI_PREFILTER
+#define MITM_MPI_PREFILTER
+
+#include <vector>
+#include <climits>
+#include <err.h>
+#include <mpi.h>
+
+#include "dict.hpp"
+#include "mpi/common.hpp"
+
+namespace mitm {
+
+/*
+ * The Bloom filters of the dicts of all the receivers (the t-th one covers the keys stored by 
+ * receiver t), replicated in a single copy on each node: it lives in an MPI shared window owned 
+ * by the first process of the node.  Receivers MPI_Put their own filter in the copy of each node.
+ * Collective over params.world_comm.
+ */
+class ReplicatedFilter {
+	MPI_Win shm_win = MPI_WIN_NULL;
+	u64 *memory;
+	u64 n_words;                 // per receiver
+	int bits_per_key;
+
+public:
+	/* `own` is our filter (receivers only), of n_words words */
+	ReplicatedFilter(const MpiParameters &params, const vector<u64> &own, u64 n_words, int bits_per_key) 
+		: n_words(n_words), bits_per_key(bits_per_key)
+	{
+		if (n_words > INT_MAX)
+			errx(1, "MPI: ERROR! The prefilter of a receiver must have less than 2^31 words");
+		int node_rank;
+		MPI_Comm_rank(params.node_comm, &node_rank);
+		bool owner = (node_rank == 0);
+		MPI_Aint bytes = owner ? params.n_recv * n_words * sizeof(u64) : 0;
+		u64 *base;
+		MPI_Win_allocate_shared(bytes, sizeof(u64), MPI_INFO_NULL, params.node_comm, &base, &shm_win);
+		MPI_Aint size;
+		int disp_unit;
+		MPI_Win_shared_query(shm_win, 0, &size, &disp_unit, &memory);
+
+		/* the copies of all nodes, exposed to everybody */
+		vector<int> owners(params.size);
+		int me = owner ? 1 : 0;
+		MPI_Allgather(&me, 1, MPI_INT, owners.data(), 1, MPI_INT, params.world_comm);
+		MPI_Win put_win;
+		MPI_Win_create(owner ? memory : nullptr, bytes, sizeof(u64), MPI_INFO_NULL, params.world_comm, &put_win);
+		MPI_Win_fence(0, put_win);
+		if (params.role == RECEIVER) {
+			assert(own.size() == n_words);
+			MPI_Aint disp = params.local_rank * n_words;
+			for (int r = 0; r < params.size; r++)
+				if (owners[r])
+					MPI_Put(own.data(), n_words, MPI_UINT64_T, r, disp, n_words, MPI_UINT64_T, put_win);
+		}
+		MPI_Win_fence(0, put_win);
+		MPI_Win_free(&put_win);
+
+		/* the others on the node read what the owner got */
+		MPI_Win_lock_all(MPI_MODE_NOCHECK, shm_win);
+		MPI_Win_sync(shm_win);
+		MPI_Barrier(params.node_comm);
+		MPI_Win_sync(shm_win);
+	}
+
+	ReplicatedFilter(const ReplicatedFilter &) = delete;
+
+	~ReplicatedFilter()
+	{
+		MPI_Win_unlock_all(shm_win);
+		MPI_Win_free(&shm_win);
+	}
+
+	/* may receiver t hold this key? */
+	bool contains(int t, u64 key) const
+	{
+		return BloomFilter(memory + t * n_words, n_words, bits_per_key).contains(key);
+	}
+
+	/* per node */
+	u64 bytes(const MpiParameters &params) const
+	{
+		return params.n_recv * n_words * sizeof(u64);
+	}
+};
+
+}
+#endif
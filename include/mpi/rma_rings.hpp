@@ -0,0 +1,102 @@
+#ifndef MITM_MPI_RMA_RINGS
+#define MITM_MPI_RMA_RINGS
+
+#include <vector>
+#include <mpi.h>
+
+#include "mpi/common.hpp"
+#include "mpi/shm_rings.hpp"
+
+namespace mitm {
+
+/*
+ * One-sided transport: each receiver exposes in an RMA window a ring of batches for each
+ * sender (same layout as the shared-memory rings).  Senders fill a batch locally, MPI_Put it
+ * in the next slot, then bump the tail of the ring atomically.  Receivers read their tails (and
+ * move their heads) with MPI atomics as well (ReceiverRings on params.work_comm): no DP goes 
+ * through a matched message.  Collective over params.work_comm.
+ */
+class RmaSenderRings : public ShmRings {
+	vector<int> rank;                  // of each receiver in work_comm
+	int k;                             // our ring in each receiver
+	vector<MpiBuffer> batch;           // count, version, data (being filled)
+	vector<u64> tail;
+	vector<u64> head;                  // last known value
+	u64 version = 0;
+
+	MPI_Aint tail_disp() const { return k * ring_size; }
+	MPI_Aint head_disp() const { return k * ring_size + 8; }
+	MPI_Aint slot_disp(u64 idx) const { return k * ring_size + header + (idx % n_slots) * slot_size; }
+
+	/* wait for a free slot in the ring of receiver t */
+	template<class Idle>
+	void acquire(int t, Idle &idle)
+	{
+		while (tail[t] - head[t] >= n_slots) {
+			MPI_Fetch_and_op(NULL, &head[t], MPI_UINT64_T, rank[t], head_disp(), MPI_NO_OP, win);
+			MPI_Win_flush(rank[t], win);
+			if (tail[t] - head[t] >= n_slots)
+				idle();
+		}
+	}
+
+	/* the data must be there before the tail moves */
+	template<class Idle>
+	void publish(int t, Idle &idle)
+	{
+		acquire(t, idle);
+		u64 count = batch[t].size() - 2;
+		batch[t][0] = count;
+		batch[t][1] = version;
+		MPI_Put(batch[t].data(), 2 + count, MPI_UINT64_T, rank[t], slot_disp(tail[t]), 2 + count, MPI_UINT64_T, win);
+		MPI_Win_flush(rank[t], win);
+		tail[t] += 1;
+		MPI_Accumulate(&tail[t], 1, MPI_UINT64_T, rank[t], tail_disp(), 1, MPI_UINT64_T, MPI_REPLACE, win);
+		MPI_Win_flush(rank[t], win);
+		batch[t].resize(2);
+	}
+
+public:
+	RmaSenderRings(const MpiParameters &params) : ShmRings(params, params.work_comm, false)
+	{
+		int me;
+		MPI_Comm_rank(params.work_comm, &me);
+		k = std::find(senders.begin(), senders.end(), me) - senders.begin();
+		rank.resize(params.n_recv);
+		for (auto [r, t] : receivers)
+			rank[t] = r;
+		batch.resize(params.n_recv);
+		for (auto &b : batch) {
+			b.reserve(slot_size);
+			b.resize(2);
+		}
+		tail.resize(params.n_recv, 0);
+		head.resize(params.n_recv, 0);
+	}
+
+	/* `idle()` is called while the ring is full */
+	template<class Idle>
+	void push3(u64 x, u64 y, u64 z, int t, Idle &idle)
+	{
+		if (batch[t].size() + 3 > slot_size)
+			publish(t, idle);
+		batch[t].push_back(x);
+		batch[t].push_back(y);
+		batch[t].push_back(z);
+	}
+
+	/* send the incomplete batches and the end-of-stream markers of the current version */
+	template<class Idle>
+	void end_version(Idle &idle)
+	{
+		for (size_t t = 0; t < batch.size(); t++) {
+			if (batch[t].size() > 2)
+				publish(t, idle);
+			publish(t, idle);
+		}
+		version += 1;
+	}
+};
+
+}
+#endif
@@ -0,0 +1,291 @@
+#ifndef MITM_MPI_SHM_RINGS
+#define MITM_MPI_SHM_RINGS
+
+#include <vector>
+#include <mpi.h>
+
+#include "mpi/common.hpp"
+
+namespace mitm {
+
+/*
+ * Transport between the senders and the receivers of the same node, that bypasses MPI.  Each
+ * receiver exposes (in an MPI shared window) a single-producer / single-consumer ring of batches
+ * for each sender of its node.  Senders write DPs directly into the ring, and receivers process
+ * them in place.  Each batch carries its version, and an empty batch ends the stream of a
+ * version (as with SendBuffers).  Collective over `comm` (params.node_work_comm).
+ *
+ * Ring layout (in u64): tail (written by the sender), head (written by the receiver) on separate
+ * cache lines, then the slots: count, version, data[capacity].
+ *
+ * The same rings also work in a plain RMA window (not shared), that senders fill with MPI_Put:
+ * cf. mpi/rma_rings.hpp.  Then the receiver accesses tail and head with MPI atomics, like the
+ * senders (mixing them with plain loads and stores is undefined).
+ */
+class ShmRings {
+protected:
+	struct Ring {
+		u64 *tail = nullptr;
+		u64 *head = nullptr;
+		u64 *slots = nullptr;
+	};
+
+	static constexpr size_t header = 16;
+	MPI_Win win;
+	bool shared;                       // else, tail and head only go through MPI atomics
+	int me;                            // our rank in comm
+	u64 *mine;                         // our part of the window
+	size_t capacity;                   // #u64 in a batch
+	u64 n_slots;                       // #batches in a ring
+	size_t slot_size;
+	size_t ring_size;
+	vector<int> senders;               // ranks in comm
+	vector<pair<int, int>> receivers;  // (rank in comm, receiver index)
+
+	Ring ring_at(u64 *memory, int k) const
+	{
+		u64 *r = memory + k * ring_size;
+		return {r, r + 8, r + header};
+	}
+
+	u64 * slot(const Ring &r, u64 idx) const
+	{
+		return r.slots + (idx % n_slots) * slot_size;
+	}
+
+	static u64 load(u64 *ptr)
+	{
+		return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+	}
+
+	static void store(u64 *ptr, u64 value)
+	{
+		__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+	}
+
+	ShmRings(const MpiParameters &params, MPI_Comm comm, bool shared) : shared(shared)
+	{
+		int n;
+		MPI_Comm_rank(comm, &me);
+		MPI_Comm_size(comm, &n);
+		int info[2] = {params.role, (params.role == RECEIVER) ? params.local_rank : -1};
+		vector<int> all(2 * n);
+		MPI_Allgather(info, 2, MPI_INT, all.data(), 2, MPI_INT, comm);
+		for (int r = 0; r < n; r++) {
+			if (all[2 * r] == SENDER)
+				senders.push_back(r);
+			if (all[2 * r] == RECEIVER)
+				receivers.push_back(pair(r, all[2 * r + 1]));
+		}
+
+		capacity = 3 * params.buffer_capacity;
+		n_slots = std::max(2, params.buffer_depth + params.max_backlog);
+		slot_size = 2 + capacity;
+		ring_size = header + n_slots * slot_size;
+		MPI_Aint bytes = (params.role == RECEIVER) ? senders.size() * ring_size * sizeof(u64) : 0;
+		if (shared)
+			MPI_Win_allocate_shared(bytes, sizeof(u64), MPI_INFO_NULL, comm, &mine, &win);
+		else
+			MPI_Win_allocate(bytes, sizeof(u64), MPI_INFO_NULL, comm, &mine, &win);
+		if (params.role == RECEIVER)
+			for (size_t k = 0; k < senders.size(); k++) {
+				Ring r = ring_at(mine, k);
+				*r.tail = 0;
+				*r.head = 0;
+			}
+		MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+		MPI_Win_sync(win);
+		MPI_Barrier(comm);
+		MPI_Win_sync(win);
+	}
+
+	/* memory of the rings of a receiver (shared window only) */
+	u64 * memory_of(int rank)
+	{
+		MPI_Aint size;
+		int disp_unit;
+		u64 *base;
+		MPI_Win_shared_query(win, rank, &size, &disp_unit, &base);
+		return base;
+	}
+
+public:
+	~ShmRings()
+	{
+		MPI_Win_unlock_all(win);
+		MPI_Win_free(&win);
+	}
+};
+
+
+/* the sender side: one ring in each receiver of the node */
+class SenderRings : public ShmRings {
+	vector<Ring> ring;                 // for each receiver (empty if on another node)
+	vector<u64> tail;                  // our copy
+	vector<u64 *> batch;               // being filled (or nullptr)
+	vector<size_t> fill;
+	vector<int> local;                 // receiver indices on our node
+	u64 version = 0;
+
+	/* wait for a free slot */
+	template<class Idle>
+	u64 * acquire(int t, Idle &idle)
+	{
+		while (tail[t] - load(ring[t].head) >= n_slots)
+			idle();
+		return slot(ring[t], tail[t]);
+	}
+
+	void publish(int t)
+	{
+		batch[t][0] = fill[t];
+		batch[t][1] = version;
+		tail[t] += 1;
+		store(ring[t].tail, tail[t]);
+		batch[t] = nullptr;
+		fill[t] = 0;
+	}
+
+public:
+	SenderRings(const MpiParameters &params) : ShmRings(params, params.node_work_comm, true)
+	{
+		ring.resize(params.n_recv);
+		tail.resize(params.n_recv, 0);
+		batch.resize(params.n_recv, nullptr);
+		fill.resize(params.n_recv, 0);
+		int me;
+		MPI_Comm_rank(params.node_work_comm, &me);
+		int k = std::find(senders.begin(), senders.end(), me) - senders.begin();
+		for (auto [rank, t] : receivers) {
+			ring[t] = ring_at(memory_of(rank), k);
+			local.push_back(t);
+		}
+	}
+
+	/* is receiver t on our node? */
+	bool is_local(int t) const
+	{
+		return ring[t].slots != nullptr;
+	}
+
+	/* `idle()` is called while the ring is full */
+	template<class Idle>
+	void push3(u64 x, u64 y, u64 z, int t, Idle &idle)
+	{
+		if (fill[t] + 3 > capacity)
+			publish(t);
+		if (batch[t] == nullptr)
+			batch[t] = acquire(t, idle);
+		u64 *data = batch[t] + 2;
+		data[fill[t]] = x;
+		data[fill[t] + 1] = y;
+		data[fill[t] + 2] = z;
+		fill[t] += 3;
+	}
+
+	/* send the incomplete batches and the end-of-stream markers of the current version */
+	template<class Idle>
+	void end_version(Idle &idle)
+	{
+		for (int t : local) {
+			if (fill[t] > 0)
+				publish(t);
+			batch[t] = acquire(t, idle);
+			publish(t);
+		}
+		version += 1;
+	}
+};
+
+
+/* the receiver side: one ring for each sender (of the node, or of all nodes with RMA) */
+class ReceiverRings : public ShmRings {
+	vector<Ring> ring;
+	vector<u64> head;                  // our copy
+	size_t n_done = 0;                 // #senders done with the current version
+	size_t n_ahead = 0;                // ... with the next version
+
+	u64 load_tail(int k)
+	{
+		if (shared)
+			return load(ring[k].tail);
+		u64 tail;
+		MPI_Fetch_and_op(NULL, &tail, MPI_UINT64_T, me, k * ring_size, MPI_NO_OP, win);
+		MPI_Win_flush(me, win);
+		return tail;
+	}
+
+	void store_head(int k)
+	{
+		if (shared) {
+			store(ring[k].head, head[k]);
+			return;
+		}
+		MPI_Accumulate(&head[k], 1, MPI_UINT64_T, me, k * ring_size + 8, 1, MPI_UINT64_T, MPI_REPLACE, win);
+		MPI_Win_flush(me, win);
+	}
+
+public:
+	ReceiverRings(const MpiParameters &params, MPI_Comm comm, bool shared) : ShmRings(params, comm, shared)
+	{
+		for (size_t k = 0; k < senders.size(); k++)
+			ring.push_back(ring_at(mine, k));
+		head.resize(ring.size(), 0);
+	}
+
+	ReceiverRings(const MpiParameters &params) : ReceiverRings(params, params.node_work_comm, true) {}
+
+	bool complete() const
+	{
+		return n_done == ring.size();
+	}
+
+	/*
+	 * Process the batches of this version that have arrived (in place, with process(data, size)).
+	 * Those of the next version are appended to `backlog`, later ones are left in the ring.
+	 * Return #batches consumed.
+	 */
+	template<class Process, class Buffer>
+	int consume(u64 version, Process &process, Buffer &backlog)
+	{
+		int n = 0;
+		for (size_t k = 0; k < ring.size(); k++) {
+			u64 tail = load_tail(k);
+			MPI_Win_sync(win);        // the slots up to tail are there
+			u64 start = head[k];
+			for (; head[k] < tail; head[k]++) {
+				u64 *s = slot(ring[k], head[k]);
+				u64 count = s[0];
+				u64 *data = s + 2;
+				if (s[1] > version + 1)
+					break;             // the sender is way ahead of us: it waits
+				if (s[1] == version) {
+					if (count == 0)
+						n_done += 1;
+					else
+						process(data, count);
+				} else {
+					if (count == 0)
+						n_ahead += 1;
+					else
+						backlog.insert(backlog.end(), data, data + count);
+				}
+				n += 1;
+			}
+			if (head[k] != start)
+				store_head(k);
+		}
+		return n;
+	}
+
+	/* move on to the next version.  Only call this when complete() returned true */
+	void next_version()
+	{
+		assert(complete());
+		n_done = n_ahead;
+		n_ahead = 0;
+	}
+};
+
+}
+#endif
@@ -72,5 +72,116 @@ public:
 		}
 	}
 };
+
+/*
+ * Evaluation by batches (for the naive engines), through vfg() by groups of vlen when the problem
+ * has a vectorized implementation.  y[i] = f(x[i]) (or g(x[i])) for i < n.
+ */
+template<class Problem>
+void batch_fg(const Problem &pb, bool use_f, const u64 x[], u64 y[], size_t n)
+{
+	constexpr int vlen = Problem::vlen;
+	size_t i = 0;
+	if (vlen > 1) {
+		u64 vx[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		u64 vy[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		bool choice[vlen];
+		for (int j = 0; j < vlen; j++)
+			choice[j] = use_f;
+		for (; i + vlen <= n; i += vlen) {
+			for (int j = 0; j < vlen; j++)
+				vx[j] = x[i + j];
+			pb.vfg(vx, choice, vy);
+			for (int j = 0; j < vlen; j++)
+				y[i + j] = vy[j];
+		}
+	}
+	for (; i < n; i++)
+		y[i] = use_f ? pb.f(x[i]) : pb.g(x[i]);
+}
+
+/* body(x, f(x)) (or g(x)) for lo <= x < hi, in order */
+template<class Problem, class Body>
+void enumerate_fg(const Problem &pb, bool use_f, u64 lo, u64 hi, Body &&body)
+{
+	constexpr int vlen = Problem::vlen;
+	u64 x = lo;
+	if (vlen > 1) {
+		u64 vx[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		u64 vy[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		bool choice[vlen];
+		for (int j = 0; j < vlen; j++)
+			choice[j] = use_f;
+		for (; x + vlen <= hi; x += vlen) {
+			for (int j = 0; j < vlen; j++)
+				vx[j] = x + j;
+			pb.vfg(vx, choice, vy);
+			for (int j = 0; j < vlen; j++)
+				body(x + j, vy[j]);
+		}
+	}
+	for (; x < hi; x++)
+		body(x, use_f ? pb.f(x) : pb.g(x));
+}
+
+/* same as batch_fg(), for a collision problem (through vf()): y[i] = f(x[i]) for i < n */
+template<class Problem>
+void batch_f(const Problem &pb, const u64 x[], u64 y[], size_t n)
+{
+	constexpr int vlen = Problem::vlen;
+	size_t i = 0;
+	if (vlen > 1) {
+		u64 vx[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		u64 vy[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		for (; i + vlen <= n; i += vlen) {
+			for (int j = 0; j < vlen; j++)
+				vx[j] = x[i + j];
+			pb.vf(vx, vy);
+			for (int j = 0; j < vlen; j++)
+				y[i + j] = vy[j];
+		}
+	}
+	for (; i < n; i++)
+		y[i] = pb.f(x[i]);
+}
+
+/* same as enumerate_fg(), for a collision problem: body(x, f(x)) for lo <= x < hi, in order */
+template<class Problem, class Body>
+void enumerate_f(const Problem &pb, u64 lo, u64 hi, Body &&body)
+{
+	constexpr int vlen = Problem::vlen;
+	u64 x = lo;
+	if (vlen > 1) {
+		u64 vx[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		u64 vy[vlen] __attribute__ ((aligned(sizeof(u64) * vlen)));
+		for (; x + vlen <= hi; x += vlen) {
+			for (int j = 0; j < vlen; j++)
+				vx[j] = x + j;
+			pb.vf(vx, vy);
+			for (int j = 0; j < vlen; j++)
+				body(x + j, vy[j]);
+		}
+	}
+	for (; x < hi; x++)
+		body(x, pb.f(x));
+}
+
+/* 
+ * Weed out the false positives returned by a dict: found(i) for the i < n such that 
+ * f(y[i]) == z[i].
+ */
+template<class Problem, class Found>
+void check_f(const Problem &pb, const u64 y[], const u64 z[], size_t n, Found &&found)
+{
+	constexpr size_t chunk = std::max(Problem::vlen, 64);
+	u64 fy[chunk];
+	for (size_t i = 0; i < n; i += chunk) {
+		size_t k = std::min(chunk, n - i);
+		batch_fg(pb, true, y + i, fy, k);
+		for (size_t j = 0; j < k; j++)
+			if (fy[j] == z[i + j])
+				found(i + j);
+	}
+}
 }
 #endif
\ No newline at end of file
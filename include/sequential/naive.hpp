@@ -1,9 +1,14 @@
-#ifndef MITM
-#define MITM
+#ifndef MITM_SEQUENTIAL_NAIVE
+#define MITM_SEQUENTIAL_NAIVE
 
 #include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
 
 #include "tools.hpp"
+#include "common.hpp"
 #include "problem.hpp"
 
 /*
@@ -39,37 +44,304 @@ optional<pair<u64, u64>> naive_collision_search(AbstractProblem &Pb)
 }
 
 
+/*
+ * With n_passes > 1, pass p only stores (and probes) the f(x) and g(y) of slice p: f and g are 
+ * evaluated n_passes times, but the hash table is n_passes times smaller.
+ */
 template <class AbstractProblem>
-vector<pair<u64, u64>> naive_claw_search(AbstractProblem &Pb)
+vector<pair<u64, u64>> naive_claw_search(AbstractProblem &Pb, u64 passes = 1)
 {
     static_assert(std::is_base_of<AbstractClawProblem, AbstractProblem>::value,
         "problem not derived from mitm::AbstractClawProblem");
   
-    double start = wtime();
     u64 N = 1ull << Pb.n;
     std::unordered_multimap<u64, u64> A;
-    A.reserve(N);
-    for (u64 x = 0; x < N; x++) {
-        u64 z = Pb.f(x);
-        A.emplace(z, x);
+    A.reserve(1.1 * N / passes);
+    vector<pair<u64, u64>> result;
+    for (u64 pass = 0; pass < passes; pass++) {
+        double start = wtime();
+        A.clear();
+        enumerate_fg(Pb, true, 0, N, [&](u64 x, u64 z) {
+            if (passes == 1 || slice_of(z, passes) == pass)
+                A.emplace(z, x);
+        });
+
+        double mid = wtime();
+        printf("Fill: %.1fs\n", mid - start);
+        enumerate_fg(Pb, false, 0, N, [&](u64 y, u64 z) {
+            if (passes > 1 && slice_of(z, passes) != pass)
+                return;
+            auto range = A.equal_range(z);
+            for (auto it = range.first; it != range.second; ++it) {
+                u64 x = it->second;
+                if (Pb.is_good_pair(x, y))
+                    result.push_back(pair(x, y));
+            }
+        });
+        printf("Probe: %.1fs\n", wtime() - mid);
     }
+    return result;
+}
+
+/* as many passes as needed for the hash table to fit in params.nbytes_memory */
+template <class AbstractProblem>
+vector<pair<u64, u64>> naive_claw_search(AbstractProblem &Pb, const Parameters &params)
+{
+    constexpr double bytes_per_entry = 48;   // node + bucket of an unordered_multimap, roughly
+    u64 passes = n_passes(bytes_per_entry * (1ull << Pb.n), params.nbytes_memory);
+    if (passes > 1)
+        printf("Naive search in %" PRIu64 " passes\n", passes);
+    return naive_claw_search(Pb, passes);
+}
+
+
+/*
+ * Multithreaded versions.  Each thread gets a slice of the domain.  They fill a shared 
+ * CompactDict with lock-free inserts, then probe it in parallel, with results in per-thread 
+ * vectors.  n_threads == 0 means one per hardware thread.
+ */
+template <class Body>
+static void naive_run_threads(int n_threads, Body &&body)
+{
+    vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++)
+        threads.emplace_back(body, t);
+    for (auto &thread : threads)
+        thread.join();
+}
+
+static int naive_n_threads(int n_threads)
+{
+    if (n_threads > 0)
+        return n_threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+template <class AbstractProblem>
+vector<pair<u64, u64>> naive_claw_search_threaded(AbstractProblem &Pb, int n_threads = 0)
+{
+    static_assert(std::is_base_of<AbstractClawProblem, AbstractProblem>::value,
+        "problem not derived from mitm::AbstractClawProblem");
+
+    double start = wtime();
+    int T = naive_n_threads(n_threads);
+    u64 N = 1ull << Pb.n;
+    CompactDict dict(1.5 * N);
+    naive_run_threads(T, [&](int t) {
+        enumerate_fg(Pb, true, t * N / T, (t + 1) * N / T, [&](u64 x, u64 z) {
+            dict.insert_concurrent(z, x);
+        });
+    });
 
     double mid = wtime();
-    printf("Fill: %.1fs\n", mid - start);
+    printf("Fill: %.1fs (%d threads)\n", mid - start, T);
+    vector<vector<pair<u64, u64>>> found(T);
+    naive_run_threads(T, [&](int t) {
+        constexpr size_t batch = 4096;
+        vector<u64> ys, zs, xs, xz;
+        vector<size_t> xk;
+        auto flush = [&]() {
+            xs.clear();
+            xz.clear();
+            xk.clear();
+            dict.probe_many(zs.data(), zs.size(), [&](size_t k, u64 x) {
+                xs.push_back(x);
+                xz.push_back(zs[k]);
+                xk.push_back(k);
+            });
+            check_f(Pb, xs.data(), xz.data(), xs.size(), [&](size_t c) {
+                u64 x = xs[c];
+                u64 y = ys[xk[c]];
+                if (Pb.is_good_pair(x, y))
+                    found[t].push_back(pair(x, y));
+            });
+            ys.clear();
+            zs.clear();
+        };
+        enumerate_fg(Pb, false, t * N / T, (t + 1) * N / T, [&](u64 y, u64 z) {
+            ys.push_back(y);
+            zs.push_back(z);
+            if (ys.size() == batch)
+                flush();
+        });
+        flush();
+    });
+    printf("Probe: %.1fs\n", wtime() - mid);
+
     vector<pair<u64, u64>> result;
-    for (u64 y = 0; y < N; y++) {
-        u64 z = Pb.g(y);
-        auto range = A.equal_range(z);
-        for (auto it = range.first; it != range.second; ++it) {
-            u64 x = it->second;
-            if (Pb.is_good_pair(x, y))
-                result.push_back(pair(x, y));
+    for (auto &v : found)
+        result.insert(result.end(), v.begin(), v.end());
+    return result;
+}
+
+template <class AbstractProblem>
+optional<pair<u64, u64>> naive_collision_search_threaded(AbstractProblem &Pb, int n_threads = 0)
+{
+    static_assert(std::is_base_of<AbstractCollisionProblem, AbstractProblem>::value,
+            "problem not derived from mitm::AbstractCollisionProblem");
+
+    int T = naive_n_threads(n_threads);
+    u64 N = 1ull << Pb.n;
+    CompactDict dict(1.5 * N);
+    naive_run_threads(T, [&](int t) {
+        enumerate_f(Pb, t * N / T, (t + 1) * N / T, [&](u64 x, u64 z) {
+            dict.insert_concurrent(z, x);
+        });
+    });
+
+    /* same batches as the claw search.  All threads stop when one of them finds a collision */
+    vector<optional<pair<u64, u64>>> found(T);
+    std::atomic<bool> done = false;
+    naive_run_threads(T, [&](int t) {
+        constexpr size_t batch = 4096;
+        vector<u64> ys, zs, xs, xz, fx;
+        vector<size_t> xk;
+        auto flush = [&]() {
+            xs.clear();
+            xz.clear();
+            xk.clear();
+            dict.probe_many(zs.data(), zs.size(), [&](size_t k, u64 x) {
+                if (x == ys[k])
+                    return;
+                xs.push_back(x);
+                xz.push_back(zs[k]);
+                xk.push_back(k);
+            });
+            fx.resize(xs.size());
+            batch_f(Pb, xs.data(), fx.data(), xs.size());
+            for (size_t c = 0; c < xs.size() && not found[t]; c++)
+                if (fx[c] == xz[c] && Pb.is_good_pair(xs[c], ys[xk[c]])) {
+                    found[t] = pair(xs[c], ys[xk[c]]);
+                    done = true;
+                }
+            ys.clear();
+            zs.clear();
+        };
+        u64 hi = (t + 1) * N / T;
+        for (u64 lo = t * N / T; lo < hi && not done; lo += batch) {
+            enumerate_f(Pb, lo, std::min(hi, lo + batch), [&](u64 y, u64 z) {
+                ys.push_back(y);
+                zs.push_back(z);
+            });
+            flush();
+        }
+    });
+    for (auto &f : found)
+        if (f)
+            return f;
+    return std::nullopt;
+}
+
+
+/*
+ * Same thing, as a partitioned sort-merge join.  The (f(x), x) and (g(y), y) pairs are scattered
+ * into 2^p buckets according to the top p bits of the value, then each pair of matching buckets 
+ * is sorted (in cache) and merged.  Besides the scattering, whose 2^p write streams stay in cache,
+ * all memory accesses are sequential.  The top p bits of a value are implied by its bucket: an 
+ * entry packs the other ones with x in an Entry (u64 if they fit).  Assumes that f and g are 
+ * evenly distributed; overflowing buckets spill into a (slower) side list.
+ */
+template <class Entry, class AbstractProblem>
+vector<pair<u64, u64>> naive_claw_join(AbstractProblem &Pb, int p)
+{
+    double start = wtime();
+    u64 N = 1ull << Pb.n;
+    u64 P = 1ull << p;
+    int low_bits = Pb.m - p;
+    u64 low_mask = make_mask(low_bits);
+    u64 x_mask = make_mask(Pb.n);
+    u64 mean = N / P;
+    u64 cap = mean + 8 * std::sqrt(mean) + 16;
+
+    struct Partition {
+        vector<Entry> data;             // bucket b == data[cap * b : cap * b + fill[b]]
+        vector<u64> fill;
+        vector<pair<u64, Entry>> spill; // (bucket, entry) that did not fit, sorted
+    };
+
+    auto scatter = [&](bool use_f, Partition &part) {
+        part.data.resize(P * cap);
+        part.fill.assign(P, 0);
+        enumerate_fg(Pb, use_f, 0, N, [&](u64 x, u64 z) {
+            u64 b = (p == 0) ? 0 : z >> low_bits;
+            Entry e = ((Entry) (z & low_mask) << Pb.n) | x;
+            if (part.fill[b] < cap)
+                part.data[cap * b + part.fill[b]++] = e;
+            else
+                part.spill.push_back(pair(b, e));
+        });
+        std::sort(part.spill.begin(), part.spill.end());
+    };
+
+    /* sort bucket b (with its spilled entries, if any, in tmp) */
+    auto bucket = [&](Partition &part, u64 b, vector<Entry> &tmp) -> pair<Entry *, Entry *> {
+        Entry *lo = &part.data[cap * b];
+        Entry *hi = lo + part.fill[b];
+        auto it = std::lower_bound(part.spill.begin(), part.spill.end(), pair(b, (Entry) 0));
+        if (it != part.spill.end() && it->first == b) {
+            tmp.assign(lo, hi);
+            for (; it != part.spill.end() && it->first == b; it++)
+                tmp.push_back(it->second);
+            lo = tmp.data();
+            hi = lo + tmp.size();
+        }
+        std::sort(lo, hi);
+        return pair(lo, hi);
+    };
+
+    Partition F, G;
+    scatter(true, F);
+    scatter(false, G);
+    double mid = wtime();
+    printf("Partition: %.1fs (%zd + %zd spilled)\n", mid - start, F.spill.size(), G.spill.size());
+
+    vector<pair<u64, u64>> result;
+    vector<Entry> ftmp, gtmp;
+    for (u64 b = 0; b < P; b++) {
+        auto [i, i_end] = bucket(F, b, ftmp);
+        auto [j, j_end] = bucket(G, b, gtmp);
+        while (i < i_end && j < j_end) {
+            u64 ki = *i >> Pb.n;
+            u64 kj = *j >> Pb.n;
+            if (ki < kj) {
+                i++;
+            } else if (kj < ki) {
+                j++;
+            } else {
+                Entry *i_run = i, *j_run = j;
+                while (i_run < i_end && (u64) (*i_run >> Pb.n) == ki)
+                    i_run++;
+                while (j_run < j_end && (u64) (*j_run >> Pb.n) == kj)
+                    j_run++;
+                for (Entry *a = i; a < i_run; a++)
+                    for (Entry *c = j; c < j_run; c++) {
+                        u64 x = *a & x_mask;
+                        u64 y = *c & x_mask;
+                        if (Pb.is_good_pair(x, y))
+                            result.push_back(pair(x, y));
+                    }
+                i = i_run;
+                j = j_run;
+            }
         }
     }
-    printf("Probe: %.1fs\n", wtime() - mid);
+    printf("Join: %.1fs\n", wtime() - mid);
     return result;
 }
 
+template <class AbstractProblem>
+vector<pair<u64, u64>> naive_claw_search_join(AbstractProblem &Pb)
+{
+    static_assert(std::is_base_of<AbstractClawProblem, AbstractProblem>::value,
+        "problem not derived from mitm::AbstractClawProblem");
+
+    int p = std::min(Pb.m, std::max(0, Pb.n - 16));   // buckets of 2^16 entries: they fit in L2
+    if (Pb.m - p + Pb.n <= 64)
+        return naive_claw_join<u64>(Pb, p);
+    else
+        return naive_claw_join<unsigned __int128>(Pb, p);
+}
+
 }
 
 #endif